@@ -1,124 +1,4050 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <memory>
 #include <sys/stat.h>
 #include <sys/clonefile.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
+#include <cstdlib>
 #include <filesystem>
 #include <vector>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctime>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <sys/mount.h>
+#include <dirent.h>
 #include <signal.h>
+#include <set>
+#include <climits>
+#include <sys/event.h>
+#include <sys/resource.h>
+#include <sys/attr.h>
+#include <copyfile.h>
+#include <sys/xattr.h>
+#include <sys/acl.h>
+#include <CommonCrypto/CommonDigest.h>
 
 namespace fs = std::filesystem;
 
 // Global variable to control debug mode
 bool debug_mode = false;
 
+// Serializes output from worker threads so lines do not interleave
+std::mutex output_mutex;
+
 // Function to print error messages
 void print_error(const std::string& msg) {
-    std::cerr << msg << ": " << strerror(errno) << " (errno: " << errno << ")" << std::endl;
+    int err = errno;
+    std::lock_guard<std::mutex> lock(output_mutex);
+    std::cerr << msg << ": " << strerror(err) << " (errno: " << err << ")" << std::endl;
+}
+
+// Debug output function
+void debug_print(const std::string& msg) {
+    if (debug_mode) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "[DEBUG] " << msg << std::endl;
+    }
+}
+
+// Run fn(i) for every i in [0, count) on a pool of worker threads. Indices are
+// claimed in increasing order, so earlier items start first.
+template <typename Fn>
+void parallel_for(size_t count, Fn fn, size_t max_workers = 0) {
+    if (max_workers == 0) {
+        max_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t workers = std::min(count, max_workers);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+                fn(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Human-readable byte count
+std::string format_bytes(double bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+    size_t unit = 0;
+    while (bytes >= 1024 && unit < 5) {
+        bytes /= 1024;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+    return text;
+}
+
+// Read until the buffer is full or EOF; returns bytes read or -1 on error
+ssize_t read_full(int fd, unsigned char* buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, buffer + total, size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Streaming XXH64. Four independent accumulators keep the multipliers busy, which
+// is far cheaper than a cryptographic digest for finding duplicate candidates.
+class Xxh64 {
+public:
+    explicit Xxh64(uint64_t seed = 0)
+        : lanes_{seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1}, seed_(seed) {}
+
+    void update(const unsigned char* data, size_t size) {
+        length_ += size;
+        if (buffered_ + size < sizeof(buffer_)) {
+            memcpy(buffer_ + buffered_, data, size);
+            buffered_ += size;
+            return;
+        }
+        if (buffered_) {
+            size_t fill = sizeof(buffer_) - buffered_;
+            memcpy(buffer_ + buffered_, data, fill);
+            consume_stripe(buffer_);
+            data += fill;
+            size -= fill;
+            buffered_ = 0;
+        }
+        while (size >= sizeof(buffer_)) {
+            consume_stripe(data);
+            data += sizeof(buffer_);
+            size -= sizeof(buffer_);
+        }
+        memcpy(buffer_, data, size);
+        buffered_ = size;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (length_ >= sizeof(buffer_)) {
+            h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+            for (uint64_t lane : lanes_) {
+                h = (h ^ round(0, lane)) * kPrime1 + kPrime4;
+            }
+        } else {
+            h = seed_ + kPrime5;
+        }
+        h += length_;
+
+        const unsigned char* p = buffer_;
+        size_t left = buffered_;
+        for (; left >= 8; p += 8, left -= 8) {
+            h ^= round(0, load<uint64_t>(p));
+            h = rotl(h, 27) * kPrime1 + kPrime4;
+        }
+        if (left >= 4) {
+            h ^= uint64_t(load<uint32_t>(p)) * kPrime1;
+            h = rotl(h, 23) * kPrime2 + kPrime3;
+            p += 4;
+            left -= 4;
+        }
+        for (; left > 0; p++, left--) {
+            h ^= *p * kPrime5;
+            h = rotl(h, 11) * kPrime1;
+        }
+
+        h ^= h >> 33;
+        h *= kPrime2;
+        h ^= h >> 29;
+        h *= kPrime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * kPrime2, 31) * kPrime1; }
+
+    template <typename T>
+    static T load(const unsigned char* p) {
+        T value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    void consume_stripe(const unsigned char* p) {
+        for (int i = 0; i < 4; i++) {
+            lanes_[i] = round(lanes_[i], load<uint64_t>(p + i * 8));
+        }
+    }
+
+    uint64_t lanes_[4];
+    uint64_t seed_;
+    uint64_t length_ = 0;
+    unsigned char buffer_[32];
+    size_t buffered_ = 0;
+};
+
+// Hash the contents of an open file with XXH64, reading from the start
+bool hash_fd(int fd, uint64_t& hash) {
+    std::vector<unsigned char> buffer(1 << 20);
+    Xxh64 hasher;
+    ssize_t n;
+    while ((n = read_full(fd, buffer.data(), buffer.size())) > 0) {
+        hasher.update(buffer.data(), n);
+    }
+    hash = hasher.digest();
+    return n == 0;
+}
+
+// Hash a file's contents with XXH64
+bool hash_file(const fs::path& path, uint64_t& hash) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        print_error("Error opening " + path.string());
+        return false;
+    }
+    bool ok = hash_fd(fd, hash);
+    if (!ok) {
+        print_error("Error reading " + path.string());
+    }
+    close(fd);
+    return ok;
+}
+
+// Checksums a --manifest can list
+enum class ManifestHash { Sha256, Xxh64 };
+
+// Running checksum of file data in SHA256SUMS or xxhsum format
+class StreamDigest {
+public:
+    explicit StreamDigest(ManifestHash kind) : kind_(kind) { reset(); }
+
+    void reset() {
+        if (kind_ == ManifestHash::Sha256) {
+            CC_SHA256_Init(&sha256_);
+        } else {
+            xxh64_ = Xxh64();
+        }
+        length_ = 0;
+    }
+
+    void update(const unsigned char* data, size_t size) {
+        if (kind_ == ManifestHash::Sha256) {
+            CC_SHA256_Update(&sha256_, data, CC_LONG(size));
+        } else {
+            xxh64_.update(data, size);
+        }
+        length_ += size;
+    }
+
+    // Feed size zero bytes, for the holes of a sparse file
+    void update_zeros(uint64_t size) {
+        static const unsigned char zeros[64 << 10] = {};
+        while (size > 0) {
+            size_t n = std::min<uint64_t>(size, sizeof(zeros));
+            update(zeros, n);
+            size -= n;
+        }
+    }
+
+    uint64_t length() const { return length_; }
+
+    std::string hex() {
+        static const char digits[] = "0123456789abcdef";
+        std::string text;
+        if (kind_ == ManifestHash::Sha256) {
+            unsigned char md[CC_SHA256_DIGEST_LENGTH];
+            CC_SHA256_Final(md, &sha256_);
+            for (unsigned char byte : md) {
+                text += digits[byte >> 4];
+                text += digits[byte & 0xf];
+            }
+        } else {
+            uint64_t hash = xxh64_.digest();
+            for (int shift = 60; shift >= 0; shift -= 4) {
+                text += digits[(hash >> shift) & 0xf];
+            }
+        }
+        return text;
+    }
+
+private:
+    ManifestHash kind_;
+    CC_SHA256_CTX sha256_;
+    Xxh64 xxh64_;
+    uint64_t length_ = 0;
+};
+
+// Hash a whole file for the manifest
+bool digest_file(const fs::path& path, ManifestHash kind, std::string& hex) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        print_error("Error opening " + path.string());
+        return false;
+    }
+    std::vector<unsigned char> buffer(1 << 20);
+    StreamDigest digest(kind);
+    ssize_t n;
+    while ((n = read_full(fd, buffer.data(), buffer.size())) > 0) {
+        digest.update(buffer.data(), n);
+    }
+    if (n < 0) {
+        print_error("Error reading " + path.string());
+    }
+    close(fd);
+    hex = digest.hex();
+    return n == 0;
+}
+
+// Mechanisms that can produce a file's contents
+enum class Engine { Auto, Clone, Copyfile, Buffered, Direct };
+const char* const kEngineNames[] = {"auto", "clone", "copyfile", "buffered", "direct"};
+
+// File size classes used for engine selection: below 16K, 256K, 4M, 64M, and above
+constexpr off_t kSizeClassLimits[] = {16 << 10, 256 << 10, 4 << 20, 64 << 20};
+constexpr size_t kSizeClasses = sizeof(kSizeClassLimits) / sizeof(kSizeClassLimits[0]) + 1;
+
+size_t size_class(off_t size) {
+    size_t c = 0;
+    while (c < kSizeClasses - 1 && size >= kSizeClassLimits[c]) {
+        c++;
+    }
+    return c;
+}
+
+// Sample file size measured for each class by --calibrate
+constexpr off_t kCalibrationSamples[kSizeClasses] = {4 << 10, 64 << 10, 1 << 20, 16 << 20, 128 << 20};
+constexpr size_t kEngines = sizeof(kEngineNames) / sizeof(kEngineNames[0]);
+
+// Fastest engine per size class as measured by --calibrate for one filesystem,
+// with the measured cost of each engine (0 if unsupported or unknown)
+struct EngineTable {
+    bool calibrated = false;
+    Engine best[kSizeClasses] = {};
+    double micros[kSizeClasses][kEngines] = {};
+
+    Engine select(off_t size) const { return calibrated ? best[size_class(size)] : Engine::Clone; }
+
+    // Estimated time for one file; clones cost the same regardless of size, byte
+    // copies scale with the data. Returns 0 if no measurement exists.
+    double estimate_micros(Engine engine, off_t size) const {
+        size_t c = size_class(size);
+        double sample = micros[c][int(engine)];
+        if (engine == Engine::Clone || size <= kCalibrationSamples[c]) {
+            return sample;
+        }
+        return sample * double(size) / double(kCalibrationSamples[c]);
+    }
+};
+
+// Match a glob pattern (*, ? and [...] classes, [!...] to negate) against a name
+bool glob_match(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0;
+    size_t star_p = std::string_view::npos, star_n = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star_p = p++;
+            star_n = n;
+            continue;
+        }
+        if (p < pattern.size() && pattern[p] == '[') {
+            size_t q = p + 1;
+            bool negate = q < pattern.size() && (pattern[q] == '!' || pattern[q] == '^');
+            if (negate) {
+                q++;
+            }
+            bool matched = false;
+            size_t start = q;
+            while (q < pattern.size() && (pattern[q] != ']' || q == start)) {
+                if (q + 2 < pattern.size() && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+                    matched |= pattern[q] <= name[n] && name[n] <= pattern[q + 2];
+                    q += 3;
+                } else {
+                    matched |= pattern[q] == name[n];
+                    q++;
+                }
+            }
+            if (q < pattern.size() && matched != negate) {
+                p = q + 1;
+                n++;
+                continue;
+            }
+        } else if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+            continue;
+        }
+        if (star_p == std::string_view::npos) {
+            return false;
+        }
+        p = star_p + 1;
+        n = ++star_n;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+// Matches a name against many glob patterns at once and reports the lowest
+// numbered pattern that matches. Literal names are hashed, "lit*" and "*lit"
+// patterns live in prefix and suffix tries walked once per name, and only the
+// remaining general globs are tried one by one.
+class NameMatcher {
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    NameMatcher() : prefixes_(1), suffixes_(1) {}
+
+    void add(std::string_view pattern, uint32_t rule) {
+        size_t wildcards = 0;
+        for (char c : pattern) {
+            wildcards += c == '*' || c == '?' || c == '[';
+        }
+        if (wildcards == 0) {
+            auto inserted = exact_.emplace(std::string(pattern), rule);
+            inserted.first->second = std::min(inserted.first->second, rule);
+        } else if (wildcards == 1 && pattern.back() == '*') {
+            insert(prefixes_, pattern.substr(0, pattern.size() - 1), false, rule);
+        } else if (wildcards == 1 && pattern.front() == '*') {
+            insert(suffixes_, pattern.substr(1), true, rule);
+        } else {
+            globs_.emplace_back(std::string(pattern), rule);
+        }
+    }
+
+    uint32_t match(std::string_view name) const {
+        uint32_t best = npos;
+        auto exact = exact_.find(std::string(name));
+        if (exact != exact_.end()) {
+            best = exact->second;
+        }
+        best = std::min(best, walk(prefixes_, name, false));
+        best = std::min(best, walk(suffixes_, name, true));
+        for (const auto& glob : globs_) {
+            if (glob.second >= best) {
+                break; // globs are kept in rule order
+            }
+            if (glob_match(glob.first, name)) {
+                best = glob.second;
+            }
+        }
+        return best;
+    }
+
+private:
+    struct TrieNode {
+        std::vector<std::pair<char, uint32_t>> children;
+        uint32_t rule = npos;
+    };
+
+    static void insert(std::vector<TrieNode>& trie, std::string_view literal, bool reversed, uint32_t rule) {
+        uint32_t node = 0;
+        for (size_t i = 0; i < literal.size(); i++) {
+            char c = reversed ? literal[literal.size() - 1 - i] : literal[i];
+            uint32_t next = npos;
+            for (const auto& child : trie[node].children) {
+                if (child.first == c) {
+                    next = child.second;
+                    break;
+                }
+            }
+            if (next == npos) {
+                next = uint32_t(trie.size());
+                trie[node].children.emplace_back(c, next);
+                trie.emplace_back();
+            }
+            node = next;
+        }
+        trie[node].rule = std::min(trie[node].rule, rule);
+    }
+
+    // Lowest rule among the trie's literals that are a prefix (or suffix) of name
+    static uint32_t walk(const std::vector<TrieNode>& trie, std::string_view name, bool reversed) {
+        uint32_t best = trie[0].rule;
+        uint32_t node = 0;
+        for (size_t i = 0; i < name.size(); i++) {
+            char c = reversed ? name[name.size() - 1 - i] : name[i];
+            uint32_t next = npos;
+            for (const auto& child : trie[node].children) {
+                if (child.first == c) {
+                    next = child.second;
+                    break;
+                }
+            }
+            if (next == npos) {
+                break;
+            }
+            node = next;
+            best = std::min(best, trie[node].rule);
+        }
+        return best;
+    }
+
+    std::unordered_map<std::string, uint32_t> exact_;
+    std::vector<TrieNode> prefixes_;
+    std::vector<TrieNode> suffixes_;
+    std::vector<std::pair<std::string, uint32_t>> globs_;
+};
+
+// --include/--exclude rules plus size and age limits, compiled once and applied
+// to raw entry names during the walk. As in rsync, the first matching rule
+// decides and unmatched entries are included; a trailing / restricts a pattern
+// to directories. Excluded directories are never opened.
+class FilterRules {
+public:
+    void add(std::string pattern, bool include) {
+        uint32_t rule = uint32_t(include_.size());
+        include_.push_back(include);
+        bool dir_only = pattern.size() > 1 && pattern.back() == '/';
+        if (dir_only) {
+            pattern.pop_back();
+        } else {
+            files_.add(pattern, rule);
+        }
+        dirs_.add(pattern, rule);
+    }
+
+    bool has_rules() const { return !include_.empty(); }
+
+    bool active() const { return has_rules() || has_limits(); }
+
+    bool has_limits() const {
+        return min_size > 0 || max_size < std::numeric_limits<off_t>::max() || newer_than > 0 ||
+               older_than < std::numeric_limits<time_t>::max();
+    }
+
+    bool allows_name(std::string_view name, bool is_dir) const {
+        uint32_t rule = (is_dir ? dirs_ : files_).match(name);
+        return rule == NameMatcher::npos || include_[rule];
+    }
+
+    // Size and age limits apply to files only
+    bool allows_file(const struct stat& st) const {
+        return st.st_size >= min_size && st.st_size <= max_size && st.st_mtime >= newer_than &&
+               st.st_mtime <= older_than;
+    }
+
+    off_t min_size = 0;
+    off_t max_size = std::numeric_limits<off_t>::max();
+    time_t newer_than = 0;                                     // oldest mtime allowed
+    time_t older_than = std::numeric_limits<time_t>::max(); // newest mtime allowed
+
+private:
+    std::vector<bool> include_;
+    NameMatcher files_;
+    NameMatcher dirs_;
+};
+
+// Match a slash-separated path against a gitignore-style pattern: wildcards stay
+// within one component and a "**" component matches any number of them
+bool path_glob_match(std::string_view pattern, std::string_view path) {
+    if (pattern.empty()) {
+        return path.empty();
+    }
+    size_t pslash = pattern.find('/');
+    std::string_view head = pattern.substr(0, pslash);
+    std::string_view rest = pslash == std::string_view::npos ? std::string_view() : pattern.substr(pslash + 1);
+    if (head == "**") {
+        if (rest.empty()) {
+            return true;
+        }
+        for (;;) {
+            if (path_glob_match(rest, path)) {
+                return true;
+            }
+            size_t slash = path.find('/');
+            if (slash == std::string_view::npos) {
+                return false;
+            }
+            path.remove_prefix(slash + 1);
+        }
+    }
+    size_t slash = path.find('/');
+    if (!glob_match(head, path.substr(0, slash))) {
+        return false;
+    }
+    if (pslash == std::string_view::npos) {
+        return slash == std::string_view::npos;
+    }
+    return slash != std::string_view::npos && path_glob_match(rest, path.substr(slash + 1));
+}
+
+// The rules of one directory's .gitignore and .ignore files. Git semantics: the
+// last matching rule wins and "!" re-includes. Patterns without an inner slash
+// match the entry name at any depth and go into NameMatchers (numbered in
+// reverse, so the matcher's lowest index is the file's last rule); patterns with
+// one are anchored to this directory and matched against the relative path.
+class IgnoreRules {
+public:
+    void add_line(std::string line) {
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\t' || line.back() == '\r')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            return;
+        }
+        Rule rule;
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.erase(0, 1);
+        } else if (line[0] == '\\') {
+            line.erase(0, 1);
+        }
+        if (line.size() > 1 && line.back() == '/') {
+            rule.dir_only = true;
+            line.pop_back();
+        }
+        rule.anchored = line.find('/') != std::string::npos;
+        if (line[0] == '/') {
+            line.erase(0, 1);
+        }
+        if (line.empty()) {
+            return;
+        }
+        rule.pattern = std::move(line);
+        rules_.push_back(std::move(rule));
+    }
+
+    bool read(int dfd, const char* name) {
+        int fd = openat(dfd, name, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        std::string text;
+        unsigned char buffer[4096];
+        ssize_t n;
+        while ((n = read_full(fd, buffer, sizeof(buffer))) > 0) {
+            text.append(reinterpret_cast<char*>(buffer), size_t(n));
+            if (size_t(n) < sizeof(buffer)) {
+                break;
+            }
+        }
+        close(fd);
+        std::istringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            add_line(line);
+        }
+        return true;
+    }
+
+    // Build the matchers once all lines have been added
+    void compile() {
+        uint32_t count = uint32_t(rules_.size());
+        for (uint32_t i = 0; i < count; i++) {
+            const Rule& rule = rules_[i];
+            if (rule.anchored) {
+                anchored_.push_back(i);
+                continue;
+            }
+            if (!rule.dir_only) {
+                files_.add(rule.pattern, count - 1 - i);
+            }
+            dirs_.add(rule.pattern, count - 1 - i);
+        }
+    }
+
+    bool empty() const { return rules_.empty(); }
+
+    bool has_anchored() const { return !anchored_.empty(); }
+
+    // 1 if ignored, 0 if re-included, -1 if no rule matches. relative is the
+    // entry's path below this directory, needed only for anchored rules.
+    int match(std::string_view name, std::string_view relative, bool is_dir) const {
+        uint32_t count = uint32_t(rules_.size());
+        uint32_t reversed = (is_dir ? dirs_ : files_).match(name);
+        int64_t best = reversed == NameMatcher::npos ? -1 : int64_t(count - 1 - reversed);
+        for (auto it = anchored_.rbegin(); it != anchored_.rend() && int64_t(*it) > best; ++it) {
+            const Rule& rule = rules_[*it];
+            if ((!rule.dir_only || is_dir) && path_glob_match(rule.pattern, relative)) {
+                best = *it;
+            }
+        }
+        return best < 0 ? -1 : rules_[best].negate ? 0 : 1;
+    }
+
+private:
+    struct Rule {
+        std::string pattern;
+        bool negate = false;
+        bool dir_only = false;
+        bool anchored = false;
+    };
+
+    std::vector<Rule> rules_;
+    std::vector<uint32_t> anchored_;
+    NameMatcher files_;
+    NameMatcher dirs_;
+};
+
+// Options controlling how files and trees are copied
+struct CopyOptions {
+    bool preserve_permissions = false;
+    bool backup = false;
+    bool update = false;
+    fs::path store; // content-addressed store to materialize files from (--store)
+    fs::path reflink_dest; // previous snapshot to clone unchanged files from (--reflink-dest)
+    bool checksum = false; // compare against reflink_dest by content rather than size and mtime
+    size_t keep = 0; // snapshots to retain next to the target, 0 to keep all (--keep)
+    uint64_t direct_threshold = 1ULL << 30; // byte copies at least this large bypass the page cache
+    bool nocache = false; // keep buffered byte copies from growing the page cache (--nocache)
+    uint64_t parallel_threshold = 4ULL << 30; // byte copies at least this large are split across threads
+    bool preallocate = true; // reserve a byte copy's blocks up front (--no-preallocate for thin storage)
+    EngineTable engines; // calibrated engine choices for the target filesystem
+    size_t jobs = 0; // worker threads for copying a tree's files, 0 for one per core (--jobs)
+    bool inode_order = false; // visit entries by inode and copy data by disk position (--inode-order)
+    bool dry_run = false; // plan and report without writing anything (--dry-run)
+    bool verify = false; // check the copy against the source afterwards (--verify)
+    fs::path manifest; // checksum manifest to write for the target, empty for none (--manifest)
+    ManifestHash manifest_hash = ManifestHash::Sha256;
+    fs::path index; // sidecar file of directory summaries, empty for none (--index)
+    bool shallow = false; // leave existing target subdirectories alone (--watch resyncs)
+    bool replace_outdated = false; // update mode replaces outdated targets instead of failing (--watch)
+    std::vector<fs::path> layers; // lower source layers, lowest first (--layer)
+    bool mirror = false; // delete target entries missing from the source (--delete)
+    uint64_t max_delete = 1000; // refuse to delete more entries than this (--max-delete)
+    FilterRules filter; // entries to skip during the walk (--include, --exclude, size and age limits)
+    bool gitignore = false; // skip entries ignored by .gitignore/.ignore files in the tree (--gitignore)
+};
+
+// Progress counters, bumped by workers with relaxed atomics and read by the
+// --progress reporter thread
+struct ProgressCounters {
+    std::atomic<uint64_t> dirs{0};
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes_cloned{0};
+    std::atomic<uint64_t> bytes_copied{0};
+    std::atomic<uint64_t> bytes_skipped{0}; // already current in the target (-u)
+    std::atomic<uint64_t> total_files{0}; // known once the walk has finished
+    std::atomic<uint64_t> total_bytes{0};
+};
+ProgressCounters progress;
+
+// Bytes of completed byte copies made by this thread, so a job can tell how much
+// of its file was copied rather than cloned
+thread_local uint64_t thread_bytes_copied = 0;
+
+inline void count_copied(uint64_t bytes) {
+    progress.bytes_copied.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// Set while a manifest entry is being produced. The byte copies below feed it the
+// data they write, in file order, so the checksum costs no extra reads. Copies
+// that cannot (clones, kernel copies, ranges copied in parallel) leave it short
+// of the file's size and the target is hashed afterwards instead.
+thread_local StreamDigest* stream_digest = nullptr;
+
+inline void digest_copied(const unsigned char* data, size_t size) {
+    if (stream_digest) {
+        stream_digest->update(data, size);
+    }
+}
+
+// Pool of aligned I/O buffers reused across files, so streaming huge files does
+// not allocate and fault in fresh buffers for each one
+class AlignedBufferPool {
+public:
+    AlignedBufferPool(size_t size, size_t alignment) : size_(size), alignment_(alignment) {}
+
+    ~AlignedBufferPool() {
+        for (unsigned char* buffer : free_) {
+            free(buffer);
+        }
+    }
+
+    unsigned char* acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                unsigned char* buffer = free_.back();
+                free_.pop_back();
+                return buffer;
+            }
+        }
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, alignment_, size_) != 0) {
+            return nullptr;
+        }
+        return static_cast<unsigned char*>(buffer);
+    }
+
+    void release(unsigned char* buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(buffer);
+    }
+
+    size_t size() const { return size_; }
+    size_t alignment() const { return alignment_; }
+
+private:
+    size_t size_;
+    size_t alignment_;
+    std::mutex mutex_;
+    std::vector<unsigned char*> free_;
+};
+
+// 8 MiB chunks aligned for uncached I/O; three in flight per file
+AlignedBufferPool direct_buffers(8 << 20, 4096);
+constexpr size_t kDirectBuffersInFlight = 3;
+
+// Copy size bytes with the page cache bypassed (F_NOCACHE). A reader thread fills
+// chunk N+1 while this thread writes chunk N. The unaligned tail is written with
+// caching re-enabled, since uncached I/O requires aligned lengths.
+bool copy_data_direct(int in, int out, const fs::path& source, const fs::path& target) {
+    debug_print("Streaming uncached copy of " + source.string());
+    fcntl(in, F_NOCACHE, 1);
+    fcntl(out, F_NOCACHE, 1);
+
+    struct Chunk {
+        unsigned char* buffer;
+        ssize_t length;
+    };
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<unsigned char*> empty;
+    std::deque<Chunk> filled;
+    bool failed = false;
+    int read_errno = 0;
+
+    for (size_t i = 0; i < kDirectBuffersInFlight; i++) {
+        unsigned char* buffer = direct_buffers.acquire();
+        if (!buffer) {
+            for (unsigned char* b : empty) {
+                direct_buffers.release(b);
+            }
+            errno = ENOMEM;
+            print_error("Error allocating copy buffers for " + source.string());
+            return false;
+        }
+        empty.push_back(buffer);
+    }
+
+    std::thread reader([&]() {
+        for (;;) {
+            unsigned char* buffer;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return !empty.empty() || failed; });
+                if (failed) {
+                    return;
+                }
+                buffer = empty.front();
+                empty.pop_front();
+            }
+            ssize_t n = read_full(in, buffer, direct_buffers.size());
+            std::lock_guard<std::mutex> lock(mutex);
+            if (n < 0) {
+                read_errno = errno;
+                failed = true;
+                empty.push_back(buffer);
+            } else {
+                filled.push_back({buffer, n});
+            }
+            changed.notify_all();
+            if (n <= 0) {
+                return;
+            }
+        }
+    });
+
+    bool ok = true;
+    for (;;) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return !filled.empty() || failed; });
+            if (filled.empty()) {
+                break;
+            }
+            chunk = filled.front();
+            filled.pop_front();
+        }
+        if (chunk.length == 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            empty.push_back(chunk.buffer);
+            break;
+        }
+        size_t aligned = chunk.length - chunk.length % direct_buffers.alignment();
+        size_t written = 0;
+        while (written < size_t(chunk.length)) {
+            if (written == aligned) {
+                fcntl(out, F_NOCACHE, 0);
+            }
+            size_t end = written < aligned ? aligned : chunk.length;
+            ssize_t n = write(out, chunk.buffer + written, end - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                print_error("Error writing " + target.string());
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+        count_copied(written);
+        if (ok) {
+            digest_copied(chunk.buffer, written);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        empty.push_back(chunk.buffer);
+        if (!ok) {
+            failed = true;
+        }
+        changed.notify_all();
+        if (!ok) {
+            break;
+        }
+    }
+    reader.join();
+
+    if (ok && read_errno) {
+        errno = read_errno;
+        print_error("Error reading " + source.string());
+        ok = false;
+    }
+    for (unsigned char* buffer : empty) {
+        direct_buffers.release(buffer);
+    }
+    for (const Chunk& chunk : filled) {
+        direct_buffers.release(chunk.buffer);
+    }
+    return ok;
+}
+
+// Cache footprint of a --nocache copy: reads are advised one window ahead and
+// written data is flushed every window
+constexpr size_t kNocacheWindow = 8 << 20;
+
+// Advise the kernel to start reading [offset, offset + length) in the background
+void advise_read_ahead(int fd, off_t offset, size_t length) {
+    struct radvisory advice;
+    advice.ra_offset = offset;
+    advice.ra_count = int(length);
+    fcntl(fd, F_RDADVISE, &advice);
+}
+
+// Copy file data through the page cache with a plain read/write loop. With
+// --nocache, pages are not retained once consumed (F_NOCACHE), the next window is
+// read ahead explicitly (F_RDADVISE), and dirty data is written back every window,
+// so the copy's cache footprint stays around two windows.
+bool copy_data_buffered(int in, int out, const fs::path& source, const fs::path& target, const CopyOptions& options) {
+    debug_print("Buffered copy of " + source.string());
+    thread_local std::vector<unsigned char> buffer(1 << 20);
+    off_t offset = 0;
+    off_t next_window = 0;
+    if (options.nocache) {
+        fcntl(in, F_NOCACHE, 1);
+        fcntl(out, F_NOCACHE, 1);
+    }
+    for (;;) {
+        if (options.nocache && offset >= next_window) {
+            advise_read_ahead(in, next_window + kNocacheWindow, kNocacheWindow);
+            if (next_window > 0 && fsync(out) != 0) {
+                print_error("Error flushing " + target.string());
+                return false;
+            }
+            if (next_window == 0) {
+                advise_read_ahead(in, 0, kNocacheWindow);
+            }
+            next_window += kNocacheWindow;
+        }
+        ssize_t n = read_full(in, buffer.data(), buffer.size());
+        if (n < 0) {
+            print_error("Error reading " + source.string());
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out, buffer.data() + written, n - written);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w < 0) {
+                print_error("Error writing " + target.string());
+                return false;
+            }
+            written += w;
+        }
+        offset += n;
+        count_copied(n);
+        digest_copied(buffer.data(), n);
+    }
+}
+
+// Reserve blocks for size bytes, contiguous if possible, and set the file's length
+bool preallocate(int out, off_t size) {
+    fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0};
+    if (fcntl(out, F_PREALLOCATE, &store) != 0) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(out, F_PREALLOCATE, &store) != 0) {
+            debug_print("Preallocation not supported, continuing without it");
+        }
+    }
+    return ftruncate(out, size) == 0;
+}
+
+// A byte range of a file
+struct ByteRange {
+    off_t offset;
+    off_t length;
+};
+
+// Split [0, size) into at most parts ranges of at least min_length bytes, with
+// every boundary on a multiple of granularity
+std::vector<ByteRange> split_ranges(off_t size, size_t parts, off_t min_length, off_t granularity) {
+    parts = std::max<size_t>(1, std::min<size_t>(parts, size / std::max<off_t>(min_length, 1)));
+    off_t step = (size / parts + granularity - 1) / granularity * granularity;
+    std::vector<ByteRange> ranges;
+    for (off_t offset = 0; offset < size; offset += step) {
+        ranges.push_back({offset, std::min(step, size - offset)});
+    }
+    return ranges;
+}
+
+// Smallest range worth handing to its own thread
+constexpr off_t kMinParallelRange = 64 << 20;
+
+// Threads that range copies may start in addition to the thread calling them. The
+// budget is shared by every file, so huge files copied at once by the tree's
+// workers do not each start a thread per core.
+class ThreadBudget {
+public:
+    void reset(size_t threads) { available_ = threads; }
+
+    // Take up to wanted threads from the budget; returns how many were granted
+    size_t claim(size_t wanted) {
+        size_t available = available_.load();
+        size_t granted;
+        do {
+            granted = std::min(available, wanted);
+        } while (!available_.compare_exchange_weak(available, available - granted));
+        return granted;
+    }
+
+    void release(size_t threads) { available_ += threads; }
+
+private:
+    std::atomic<size_t> available_{0};
+};
+ThreadBudget range_threads;
+
+// Copy size bytes from start by splitting them into ranges copied concurrently
+// with pread/pwrite
+bool copy_data_parallel(int in, int out, off_t size, const fs::path& source, const fs::path& target, bool uncached,
+                        off_t start = 0) {
+    size_t wanted = std::max<off_t>(1, size / kMinParallelRange);
+    size_t extra = range_threads.claim(wanted - 1);
+    std::vector<ByteRange> ranges = split_ranges(size, extra + 1, kMinParallelRange, direct_buffers.size());
+    debug_print("Parallel copy of " + source.string() + " in " + std::to_string(ranges.size()) + " ranges");
+    if (uncached) {
+        fcntl(in, F_NOCACHE, 1);
+        fcntl(out, F_NOCACHE, 1);
+    }
+
+    std::atomic<bool> ok{true};
+    auto copy_range = [&](size_t r) {
+        unsigned char* buffer = direct_buffers.acquire();
+        if (!buffer) {
+            errno = ENOMEM;
+            print_error("Error allocating copy buffer for " + source.string());
+            ok = false;
+            return;
+        }
+        off_t offset = start + ranges[r].offset;
+        off_t end = offset + ranges[r].length;
+        while (ok && offset < end) {
+            size_t want = std::min<off_t>(direct_buffers.size(), end - offset);
+            ssize_t n = pread(in, buffer, want, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n == 0) {
+                    errno = EIO; // source shrank while being copied
+                }
+                print_error("Error reading " + source.string());
+                ok = false;
+                break;
+            }
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = pwrite(out, buffer + written, n - written, offset + written);
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w < 0) {
+                    print_error("Error writing " + target.string());
+                    ok = false;
+                    break;
+                }
+                written += w;
+            }
+            offset += n;
+            count_copied(n);
+        }
+        direct_buffers.release(buffer);
+    };
+
+    // The calling thread copies ranges too, next to at most extra started threads
+    std::atomic<size_t> next{0};
+    auto copy_ranges = [&]() {
+        for (size_t r = next.fetch_add(1); r < ranges.size(); r = next.fetch_add(1)) {
+            copy_range(r);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < ranges.size(); t++) {
+        threads.emplace_back(copy_ranges);
+    }
+    copy_ranges();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    range_threads.release(extra);
+    return ok;
+}
+
+// Copy only the data segments of a sparse file so its holes stay holes in the
+// target. Returns false with errno EINVAL if the filesystem cannot report holes.
+// The engine choices for whole files apply per file or segment: uncached copies
+// and --nocache bypass the page cache (--nocache also flushes every window), and
+// segments of at least the parallel threshold are copied in ranges.
+bool copy_data_sparse(int in, int out, off_t size, const fs::path& source, const fs::path& target,
+                      const CopyOptions& options, bool uncached) {
+    debug_print("Sparse copy of " + source.string());
+    thread_local std::vector<unsigned char> buffer(1 << 20);
+    if (uncached || options.nocache) {
+        fcntl(in, F_NOCACHE, 1);
+        fcntl(out, F_NOCACHE, 1);
+    }
+    off_t unflushed = 0;
+    off_t position = 0;
+    while (position < size) {
+        off_t data = lseek(in, position, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break; // only a hole remains
+            }
+            if (errno != EINVAL) {
+                print_error("Error reading " + source.string());
+            }
+            return false;
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) {
+            print_error("Error reading " + source.string());
+            return false;
+        }
+        if (stream_digest) {
+            stream_digest->update_zeros(data - position);
+        }
+        // Ranges are copied out of order, so the digest is left short and the
+        // target is hashed afterwards
+        if (uint64_t(hole - data) >= options.parallel_threshold) {
+            if (!copy_data_parallel(in, out, hole - data, source, target, uncached, data)) {
+                return false;
+            }
+            position = hole;
+            continue;
+        }
+        for (off_t offset = data; offset < hole;) {
+            ssize_t n = pread(in, buffer.data(), std::min<off_t>(buffer.size(), hole - offset), offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                print_error("Error reading " + source.string());
+                return false;
+            }
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = pwrite(out, buffer.data() + written, n - written, offset + written);
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w < 0) {
+                    print_error("Error writing " + target.string());
+                    return false;
+                }
+                written += w;
+            }
+            offset += n;
+            count_copied(n);
+            digest_copied(buffer.data(), n);
+            unflushed += n;
+            if (options.nocache && unflushed >= off_t(kNocacheWindow)) {
+                if (fsync(out) != 0) {
+                    print_error("Error flushing " + target.string());
+                    return false;
+                }
+                unflushed = 0;
+            }
+        }
+        position = hole;
+    }
+    if (stream_digest && position < size) {
+        stream_digest->update_zeros(size - position);
+    }
+    if (ftruncate(out, size) != 0) {
+        print_error("Error writing " + target.string());
+        return false;
+    }
+    return true;
+}
+
+// What a pair of volumes supports, probed once per (source device, target device)
+struct VolumeCaps {
+    bool clone = true;          // clonefile() works from source to target
+    bool xattrs = true;         // target keeps extended attributes
+    bool case_sensitive = true; // target distinguishes names that differ in case
+};
+
+// Read the format and interface capabilities of the volume holding path
+bool volume_capabilities(const fs::path& path, uint32_t& format, uint32_t& interfaces) {
+    struct attrlist request = {};
+    request.bitmapcount = ATTR_BIT_MAP_COUNT;
+    request.volattr = ATTR_VOL_INFO | ATTR_VOL_CAPABILITIES;
+    struct {
+        uint32_t length;
+        vol_capabilities_attr_t caps;
+    } __attribute__((aligned(4), packed)) reply;
+    if (getattrlist(path.c_str(), &request, &reply, sizeof(reply), 0) != 0) {
+        return false;
+    }
+    format = reply.caps.capabilities[VOL_CAPABILITIES_FORMAT] & reply.caps.valid[VOL_CAPABILITIES_FORMAT];
+    interfaces = reply.caps.capabilities[VOL_CAPABILITIES_INTERFACES] & reply.caps.valid[VOL_CAPABILITIES_INTERFACES];
+    return true;
+}
+
+// Probe a volume pair. Anything that cannot be probed is assumed supported, so
+// the copy finds out the way it did before.
+VolumeCaps probe_volumes(dev_t source_dev, dev_t target_dev, const fs::path& source, const fs::path& target) {
+    VolumeCaps caps;
+    uint32_t format = 0, interfaces = 0;
+    bool known = volume_capabilities(target, format, interfaces);
+    caps.clone = source_dev == target_dev && (!known || (interfaces & VOL_CAP_INT_CLONE));
+    caps.xattrs = !known || (interfaces & VOL_CAP_INT_EXTENDED_ATTR);
+    caps.case_sensitive = !known || (format & VOL_CAP_FMT_CASE_SENSITIVE);
+
+    uint32_t source_format = 0, source_interfaces = 0;
+    if (!caps.case_sensitive && volume_capabilities(source, source_format, source_interfaces) &&
+        (source_format & VOL_CAP_FMT_CASE_SENSITIVE)) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Warning: " << target << " is on a case-insensitive volume; source names that differ only in case "
+                  << "will collide" << std::endl;
+    }
+    debug_print("Volume capabilities for " + source.string() + " -> " + target.string() + ": clone " +
+                std::to_string(caps.clone) + ", xattrs " + std::to_string(caps.xattrs) + ", case-sensitive " +
+                std::to_string(caps.case_sensitive));
+    return caps;
+}
+
+// Probe results shared by all workers. A fixed open-addressed table: a slot is
+// claimed with a compare-and-swap, filled by the thread that claimed it, and
+// published with a release store, so lookups never take a lock.
+class VolumeCapsCache {
+public:
+    VolumeCaps get(dev_t source_dev, dev_t target_dev, const fs::path& source, const fs::path& target) {
+        size_t hash = std::hash<uint64_t>()(uint64_t(source_dev) * 0x9e3779b97f4a7c15ull ^ uint64_t(target_dev));
+        for (size_t i = 0; i < kSlots; i++) {
+            Slot& slot = slots_[(hash + i) % kSlots];
+            int state = slot.state.load(std::memory_order_acquire);
+            if (state == kEmpty && slot.state.compare_exchange_strong(state, kFilling, std::memory_order_acq_rel)) {
+                slot.source_dev = source_dev;
+                slot.target_dev = target_dev;
+                slot.caps = probe_volumes(source_dev, target_dev, source, target);
+                slot.state.store(kReady, std::memory_order_release);
+                return slot.caps;
+            }
+            while (state == kFilling) {
+                std::this_thread::yield();
+                state = slot.state.load(std::memory_order_acquire);
+            }
+            if (slot.source_dev == source_dev && slot.target_dev == target_dev) {
+                return slot.caps;
+            }
+        }
+        return probe_volumes(source_dev, target_dev, source, target); // table full
+    }
+
+private:
+    static constexpr size_t kSlots = 64;
+    static constexpr int kEmpty = 0, kFilling = 1, kReady = 2;
+
+    struct Slot {
+        std::atomic<int> state{kEmpty};
+        dev_t source_dev;
+        dev_t target_dev;
+        VolumeCaps caps;
+    };
+    Slot slots_[kSlots];
+};
+VolumeCapsCache volume_caps;
+
+// Give a finished byte copy the source's metadata and close both descriptors
+bool finish_fallback_copy(int in, int out, const struct stat& st, const fs::path& target, bool xattrs) {
+    bool ok = true;
+    struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+    if (xattrs) {
+        fcopyfile(in, out, nullptr, COPYFILE_XATTR);
+    }
+    if (fchmod(out, st.st_mode & 07777) != 0 || futimens(out, times) != 0) {
+        print_error("Error setting attributes on " + target.string());
+        ok = false;
+    }
+    close(in);
+    if (close(out) != 0 && ok) {
+        print_error("Error writing " + target.string());
+        ok = false;
+    }
+    if (!ok) {
+        unlink(target.c_str());
+    } else {
+        thread_bytes_copied += st.st_size;
+    }
+    return ok;
+}
+
+// Discard a failed byte copy
+bool abort_fallback_copy(int in, int out, const fs::path& target) {
+    close(in);
+    close(out);
+    unlink(target.c_str());
+    return false;
+}
+
+// Byte copy for when the filesystem cannot clone. The result carries the source's
+// mode, times and extended attributes, as a clone would.
+// Engine::Auto picks an engine from the size thresholds in options.
+bool copy_file_fallback(const fs::path& source, const fs::path& target, const CopyOptions& options,
+                        Engine engine = Engine::Auto, const VolumeCaps* caps = nullptr) {
+    debug_print("Entering copy_file_fallback()");
+    // O_NONBLOCK keeps a FIFO from blocking the open; only regular files are copied
+    int in = open(source.c_str(), O_RDONLY | O_NONBLOCK);
+    if (in < 0) {
+        print_error("Error opening " + source.string());
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        print_error("Error reading " + source.string());
+        close(in);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(in);
+        errno = ENOTSUP;
+        print_error("Not a regular file, cannot copy " + source.string());
+        return false;
+    }
+    fcntl(in, F_SETFL, 0);
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+    if (out < 0) {
+        if (errno == EEXIST) {
+            debug_print("Target already exists: " + target.string());
+        } else {
+            print_error("Error creating " + target.string());
+        }
+        close(in);
+        return false;
+    }
+
+    // Sparse files keep their holes; everything else gets its blocks reserved up
+    // front so the allocator can lay the file out in few extents
+    bool sparse = st.st_size > 0 && off_t(st.st_blocks) * 512 < st.st_size;
+    if (sparse) {
+        bool uncached = engine == Engine::Direct ||
+                        (engine == Engine::Auto && uint64_t(st.st_size) >= options.direct_threshold);
+        if (copy_data_sparse(in, out, st.st_size, source, target, options, uncached)) {
+            return finish_fallback_copy(in, out, st, target, !caps || caps->xattrs);
+        }
+        if (errno != EINVAL) {
+            return abort_fallback_copy(in, out, target);
+        }
+        lseek(in, 0, SEEK_SET);
+        if (stream_digest) {
+            stream_digest->reset();
+        }
+    } else if (options.preallocate && st.st_size > 0 && !preallocate(out, st.st_size)) {
+        print_error("Error allocating " + target.string());
+        return abort_fallback_copy(in, out, target);
+    }
+
+    bool ok;
+    if (uint64_t(st.st_size) >= options.parallel_threshold) {
+        ok = copy_data_parallel(in, out, st.st_size, source, target,
+                                uint64_t(st.st_size) >= options.direct_threshold);
+    } else if (engine == Engine::Direct || (engine == Engine::Auto && uint64_t(st.st_size) >= options.direct_threshold)) {
+        ok = copy_data_direct(in, out, source, target);
+    } else if (engine == Engine::Copyfile) {
+        ok = fcopyfile(in, out, nullptr, COPYFILE_DATA) == 0;
+        if (!ok) {
+            print_error("Error copying " + source.string() + " to " + target.string());
+        } else {
+            count_copied(st.st_size);
+        }
+    } else {
+        ok = copy_data_buffered(in, out, source, target, options);
+    }
+
+    if (!ok) {
+        return abort_fallback_copy(in, out, target);
+    }
+    return finish_fallback_copy(in, out, st, target, !caps || caps->xattrs);
+}
+
+// Clone a file using clonefile function. caps, when known, describes the volumes
+// involved; pairs that cannot clone go straight to a byte copy.
+// size is the source's size if the caller already knows it, or -1
+bool clone_file(const fs::path& source, const fs::path& target, const CopyOptions& options, uint32_t flags = 0,
+                const VolumeCaps* caps = nullptr, off_t size = -1) {
+    debug_print("Entering clone_file()");
+    debug_print("Parameters: source = " + source.string() + ", target = " + target.string() + ", flags = " + std::to_string(flags));
+
+    // Existing targets are not looked up first: clonefile() and the byte copies
+    // create the target exclusively and fail with EEXIST if it is already there
+
+    // A calibrated filesystem may copy some size classes faster than it clones them
+    if (options.engines.calibrated) {
+        struct stat st;
+        if (size < 0 && stat(source.c_str(), &st) == 0) {
+            size = st.st_size;
+        }
+        if (size >= 0) {
+            Engine engine = options.engines.select(size);
+            if (engine != Engine::Clone) {
+                debug_print(std::string("Calibrated engine for this size: ") + kEngineNames[int(engine)]);
+                return copy_file_fallback(source, target, options, engine, caps);
+            }
+        }
+    }
+
+    if (caps && !caps->clone) {
+        debug_print("Volumes cannot clone, copying " + source.string());
+        return copy_file_fallback(source, target, options, Engine::Auto, caps);
+    }
+
+    debug_print("Cloning file from " + source.string() + " to " + target.string());
+    int result = clonefile(source.c_str(), target.c_str(), flags);
+    if (result != 0) {
+        if (errno == EEXIST) {
+            debug_print("Target already exists: " + target.string());
+            return false; // Don't proceed if the target already exists
+        }
+        // Different volumes or no clone support: copy the bytes instead
+        if (errno == EXDEV || errno == ENOTSUP) {
+            debug_print("Cloning not possible, falling back to a byte copy");
+            return copy_file_fallback(source, target, options, Engine::Auto, caps);
+        }
+        print_error("Error cloning file from " + source.string() + " to " + target.string());
+        return false;
+    }
+    debug_print("Successfully cloned " + source.string() + " to " + target.string());
+    return true;
+}
+
+// Compare last modification times of two files
+bool is_newer(const fs::path& source, const fs::path& target) {
+    debug_print("Entering is_newer()");
+    debug_print("Parameters: source = " + source.string() + ", target = " + target.string());
+    return fs::last_write_time(source) > fs::last_write_time(target);
+}
+
+
+// Calibration results are cached per filesystem, one line per filesystem:
+//   <statfs f_type> <st_dev> <engine for each size class> [<class>:<engine>=<microseconds> ...]
+fs::path calibration_cache_path() {
+    const char* home = getenv("HOME");
+    return fs::path(home ? home : "/tmp") / "Library" / "Caches" / "cf" / "calibration";
+}
+
+// Key identifying the filesystem that holds path
+bool filesystem_key(const fs::path& path, std::string& key) {
+    struct statfs sfs;
+    struct stat st;
+    if (statfs(path.c_str(), &sfs) != 0 || stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    key = std::to_string(uint32_t(sfs.f_type)) + " " + std::to_string(st.st_dev);
+    return true;
+}
+
+// Load the calibrated engine table for the filesystem holding dir, if one exists
+void load_engine_table(const fs::path& dir, EngineTable& table) {
+    std::string key;
+    if (!filesystem_key(dir, key)) {
+        return;
+    }
+    std::ifstream cache(calibration_cache_path());
+    std::string line;
+    while (std::getline(cache, line)) {
+        if (line.compare(0, key.size() + 1, key + " ") != 0) {
+            continue;
+        }
+        std::istringstream fields(line.substr(key.size() + 1));
+        EngineTable loaded;
+        std::string name;
+        size_t c = 0;
+        for (; c < kSizeClasses && fields >> name; c++) {
+            auto it = std::find(std::begin(kEngineNames), std::end(kEngineNames), name);
+            if (it == std::end(kEngineNames)) {
+                break;
+            }
+            loaded.best[c] = Engine(it - std::begin(kEngineNames));
+        }
+        while (fields >> name) {
+            size_t colon = name.find(':');
+            size_t equals = name.find('=');
+            if (colon == std::string::npos || equals == std::string::npos || equals < colon) {
+                continue;
+            }
+            size_t cls = std::strtoul(name.c_str(), nullptr, 10);
+            auto it = std::find(std::begin(kEngineNames), std::end(kEngineNames), name.substr(colon + 1, equals - colon - 1));
+            if (cls < kSizeClasses && it != std::end(kEngineNames)) {
+                loaded.micros[cls][it - std::begin(kEngineNames)] = std::strtod(name.c_str() + equals + 1, nullptr);
+            }
+        }
+        if (c == kSizeClasses) {
+            loaded.calibrated = true;
+            table = loaded;
+            debug_print("Loaded engine calibration for filesystem " + key);
+        }
+        return;
+    }
+}
+
+// Replace the cached calibration line for key
+bool save_engine_table(const std::string& key, const EngineTable& table) {
+    fs::path cache_path = calibration_cache_path();
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(cache_path);
+        std::string line;
+        while (std::getline(cache, line)) {
+            if (line.compare(0, key.size() + 1, key + " ") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+    std::string entry = key;
+    for (Engine engine : table.best) {
+        entry += std::string(" ") + kEngineNames[int(engine)];
+    }
+    for (size_t c = 0; c < kSizeClasses; c++) {
+        for (size_t e = 0; e < kEngines; e++) {
+            if (table.micros[c][e] > 0) {
+                entry += " " + std::to_string(c) + ":" + kEngineNames[e] + "=" + std::to_string(table.micros[c][e]);
+            }
+        }
+    }
+    lines.push_back(entry);
+
+    std::error_code ec;
+    fs::create_directories(cache_path.parent_path(), ec);
+    fs::path staging = cache_path.string() + "." + std::to_string(getpid());
+    {
+        std::ofstream out(staging);
+        for (const auto& line : lines) {
+            out << line << "\n";
+        }
+        if (!out) {
+            print_error("Error writing " + staging.string());
+            return false;
+        }
+    }
+    if (rename(staging.c_str(), cache_path.c_str()) != 0) {
+        print_error("Error writing " + cache_path.string());
+        return false;
+    }
+    return true;
+}
+
+// Measure every engine on each size class in dir's filesystem and cache the
+// fastest, so later runs can dispatch by file size
+bool calibrate_filesystem(const fs::path& dir) {
+    debug_print("Entering calibrate_filesystem()");
+    std::string key;
+    if (!filesystem_key(dir, key)) {
+        print_error("Error inspecting filesystem of " + dir.string());
+        return false;
+    }
+    fs::path work = dir / (".cf-calibrate." + std::to_string(getpid()));
+    std::error_code ec;
+    if (!fs::create_directory(work, ec)) {
+        print_error("Error creating " + work.string());
+        return false;
+    }
+
+    // Engines are forced explicitly, so size thresholds must not redirect them
+    CopyOptions options;
+    options.direct_threshold = std::numeric_limits<uint64_t>::max();
+    options.parallel_threshold = std::numeric_limits<uint64_t>::max();
+    const off_t* samples = kCalibrationSamples;
+    const Engine candidates[] = {Engine::Clone, Engine::Copyfile, Engine::Buffered, Engine::Direct};
+
+    // Incompressible sample data
+    std::vector<unsigned char> data(1 << 20);
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (auto& byte : data) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        byte = static_cast<unsigned char>(state);
+    }
+
+    EngineTable table;
+    bool ok = true;
+    std::cout << "Calibrating filesystem " << key << " (microseconds per file)" << std::endl;
+    for (size_t c = 0; c < kSizeClasses && ok; c++) {
+        fs::path sample = work / "sample";
+        int fd = open(sample.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (off_t written = 0; fd >= 0 && written < samples[c];) {
+            ssize_t n = write(fd, data.data(), std::min<off_t>(data.size(), samples[c] - written));
+            if (n <= 0) {
+                close(fd);
+                fd = -1;
+                break;
+            }
+            written += n;
+        }
+        if (fd < 0 || fsync(fd) != 0 || close(fd) != 0) {
+            print_error("Error writing " + sample.string());
+            ok = false;
+            break;
+        }
+
+        size_t reps = std::clamp<size_t>((256 << 20) / samples[c], 3, 200);
+        double best_time = std::numeric_limits<double>::max();
+        std::cout << "  " << samples[c] << " bytes:";
+        for (Engine engine : candidates) {
+            auto start = std::chrono::steady_clock::now();
+            bool supported = true;
+            for (size_t r = 0; r < reps && supported; r++) {
+                fs::path copy = work / ("copy" + std::to_string(r));
+                if (engine == Engine::Clone) {
+                    supported = clonefile(sample.c_str(), copy.c_str(), 0) == 0;
+                } else {
+                    supported = copy_file_fallback(sample, copy, options, engine);
+                }
+            }
+            double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / reps;
+            for (size_t r = 0; r < reps; r++) {
+                unlink((work / ("copy" + std::to_string(r))).c_str());
+            }
+            if (!supported) {
+                std::cout << " " << kEngineNames[int(engine)] << "=unsupported";
+                continue;
+            }
+            std::cout << " " << kEngineNames[int(engine)] << "=" << static_cast<uint64_t>(micros);
+            table.micros[c][int(engine)] = micros;
+            if (micros < best_time) {
+                best_time = micros;
+                table.best[c] = engine;
+            }
+        }
+        std::cout << " -> " << kEngineNames[int(table.best[c])] << std::endl;
+    }
+    fs::remove_all(work, ec);
+    if (!ok) {
+        return false;
+    }
+    table.calibrated = true;
+    if (!save_engine_table(key, table)) {
+        return false;
+    }
+    std::cout << "Saved calibration to " << calibration_cache_path() << std::endl;
+    return true;
+}
+
+// SHA-256 of a file's contents as lowercase hex
+bool sha256_file(const fs::path& path, std::string& digest) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        print_error("Error opening " + path.string());
+        return false;
+    }
+    std::vector<unsigned char> buffer(1 << 20);
+    CC_SHA256_CTX ctx;
+    CC_SHA256_Init(&ctx);
+    ssize_t n;
+    while ((n = read_full(fd, buffer.data(), buffer.size())) > 0) {
+        CC_SHA256_Update(&ctx, buffer.data(), n);
+    }
+    if (n < 0) {
+        print_error("Error reading " + path.string());
+    }
+    close(fd);
+    unsigned char md[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(md, &ctx);
+    static const char hex[] = "0123456789abcdef";
+    digest.clear();
+    for (unsigned char byte : md) {
+        digest += hex[byte >> 4];
+        digest += hex[byte & 0xf];
+    }
+    return n == 0;
+}
+
+// Content-addressed store (--store). Layout under the store root:
+//   objects/<aa>/<rest>   file contents named by their SHA-256 digest
+//   index/<ii>/<key>      symlink from a source file's identity to its digest
+//   tmp/                  staging area for new objects
+// Workspaces are materialized by cloning objects, so each distinct content is
+// stored once and an unchanged source costs an lstat, a readlink and a clone.
+bool init_store(const fs::path& store) {
+    debug_print("Initializing content store: " + store.string());
+    try {
+        fs::create_directories(store / "objects");
+        fs::create_directories(store / "index");
+        fs::create_directories(store / "tmp");
+    } catch (const fs::filesystem_error& e) {
+        print_error(e.what());
+        return false;
+    }
+    return true;
+}
+
+fs::path store_object_path(const fs::path& store, const std::string& digest) {
+    return store / "objects" / digest.substr(0, 2) / digest.substr(2);
+}
+
+// Index entry for a source file. ctime is part of the key because it cannot be
+// set by user space, so any rewrite of the source yields a new entry.
+fs::path store_index_path(const fs::path& store, const struct stat& st) {
+    static const char hex[] = "0123456789abcdef";
+    std::string shard{hex[(st.st_ino >> 4) & 0xf], hex[st.st_ino & 0xf]};
+    std::string key = std::to_string(st.st_dev) + "-" + std::to_string(st.st_ino) + "-" +
+                      std::to_string(st.st_size) + "-" +
+                      std::to_string(st.st_mtimespec.tv_sec) + "." + std::to_string(st.st_mtimespec.tv_nsec) + "-" +
+                      std::to_string(st.st_ctimespec.tv_sec) + "." + std::to_string(st.st_ctimespec.tv_nsec);
+    return store / "index" / shard / key;
+}
+
+// Find the digest of source, hashing it and recording an index entry on a miss
+bool store_digest(const fs::path& store, const fs::path& source, const struct stat& st, std::string& digest) {
+    fs::path index = store_index_path(store, st);
+    char link[128];
+    ssize_t n = readlink(index.c_str(), link, sizeof(link) - 1);
+    if (n == 2 * CC_SHA256_DIGEST_LENGTH) {
+        digest.assign(link, n);
+        debug_print("Store index hit: " + source.string() + " -> " + digest);
+        return true;
+    }
+    if (!sha256_file(source, digest)) {
+        return false;
+    }
+    std::error_code ec;
+    fs::create_directory(index.parent_path(), ec);
+    if (symlink(digest.c_str(), index.c_str()) != 0 && errno != EEXIST) {
+        print_error("Error writing store index " + index.string());
+    }
+    return true;
+}
+
+// Add source to the store under digest unless the content is already present
+bool store_insert(const fs::path& store, const fs::path& source, const std::string& digest,
+                  const CopyOptions& options) {
+    static std::atomic<uint64_t> staging_counter{0};
+    fs::path object = store_object_path(store, digest);
+    if (access(object.c_str(), F_OK) == 0) {
+        return true;
+    }
+    debug_print("Inserting into store: " + source.string() + " as " + digest);
+    std::error_code ec;
+    fs::create_directory(object.parent_path(), ec);
+    fs::path staging = store / "tmp" / (digest + "." + std::to_string(getpid()) + "." + std::to_string(staging_counter++));
+    if (clonefile(source.c_str(), staging.c_str(), CLONE_NOOWNERCOPY) != 0) {
+        // A store on another volume, or one that cannot clone, gets a byte copy
+        if (errno != EXDEV && errno != ENOTSUP) {
+            print_error("Error cloning " + source.string() + " into store");
+            return false;
+        }
+        debug_print("Cloning into store not possible, falling back to a byte copy");
+        if (!copy_file_fallback(source, staging, options)) {
+            return false;
+        }
+    }
+    // Objects are shared by every workspace; keep them read-only
+    chmod(staging.c_str(), 0444);
+    // A concurrent insert of the same content is harmless: both are identical
+    if (rename(staging.c_str(), object.c_str()) != 0) {
+        print_error("Error adding " + object.string() + " to store");
+        unlink(staging.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Materialize target as a clone of source's content from the store
+bool materialize_from_store(const fs::path& store, const fs::path& source, const fs::path& target,
+                            const CopyOptions& options) {
+    debug_print("Materializing " + target.string() + " from store");
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0) {
+        print_error("Error reading " + source.string());
+        return false;
+    }
+    std::string digest;
+    if (!store_digest(store, source, st, digest) || !store_insert(store, source, digest, options)) {
+        return false;
+    }
+    if (!clone_file(store_object_path(store, digest), target, options, CLONE_NOOWNERCOPY, nullptr, st.st_size)) {
+        return false;
+    }
+    // Present the file as a clone of the source would be, not with the object's metadata
+    struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+    if (chmod(target.c_str(), st.st_mode & 07777) != 0 || utimensat(AT_FDCWD, target.c_str(), times, 0) != 0) {
+        print_error("Error setting attributes on " + target.string());
+        return false;
+    }
+    return true;
+}
+
+// Produce target from source using the engine selected by options. size is the
+// source's size if the caller already knows it, or -1.
+bool clone_entry(const fs::path& source, const fs::path& target, const CopyOptions& options,
+                 const VolumeCaps* caps = nullptr, off_t size = -1) {
+    if (!options.store.empty()) {
+        return materialize_from_store(options.store, source, target, options);
+    }
+    return clone_file(source, target, options, 0, caps, size);
+}
+
+// Directory metadata recorded during the walk. A directory's mode and times can
+// only be applied once its whole subtree is written: a read-only mode would block
+// creating children, and every new entry bumps the directory's mtime.
+struct DirFixup {
+    fs::path target;
+    mode_t mode;
+    struct timespec times[2]; // atime, mtime
+    size_t parent;            // index of the parent record, or npos for the root
+    size_t pending;           // outstanding work in this subtree (own walk + child directories)
+};
+
+class DirFixupTable {
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    // Record metadata for a directory about to be walked. The record stays pending
+    // until complete() has been called for it and for every child recorded under it.
+    size_t record(const fs::path& source, const fs::path& target, size_t parent) {
+        debug_print("Recording directory metadata: " + target.string());
+        struct stat st;
+        if (stat(source.c_str(), &st) != 0) {
+            print_error("Error reading directory metadata " + source.string());
+            failed_ = true;
+            return npos;
+        }
+        DirFixup fixup;
+        fixup.target = target;
+        fixup.mode = st.st_mode & 07777;
+        fixup.times[0] = st.st_atimespec;
+        fixup.times[1] = st.st_mtimespec;
+        fixup.parent = parent;
+        fixup.pending = 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (parent != npos) {
+            entries_[parent].pending++;
+        }
+        entries_.push_back(fixup);
+        return entries_.size() - 1;
+    }
+
+    // Add a unit of work (such as a file copy) that must finish before the
+    // directory's metadata is applied
+    void add_pending(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index != npos) {
+            entries_[index].pending++;
+        }
+    }
+
+    // Mark one unit of work under the directory as done, applying its metadata (and
+    // then its ancestors') as soon as the subtree has nothing left pending. Safe to
+    // call from worker threads once the walk has finished recording.
+    void complete(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (index != npos && --entries_[index].pending == 0) {
+            apply(entries_[index]);
+            index = entries_[index].parent;
+        }
+    }
+
+    bool failed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return failed_;
+    }
+
+private:
+    void apply(const DirFixup& fixup) {
+        debug_print("Applying directory metadata: " + fixup.target.string());
+        if (chmod(fixup.target.c_str(), fixup.mode) != 0) {
+            print_error("Error setting permissions on " + fixup.target.string());
+            failed_ = true;
+        }
+        if (utimensat(AT_FDCWD, fixup.target.c_str(), fixup.times, 0) != 0) {
+            print_error("Error setting times on " + fixup.target.string());
+            failed_ = true;
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<DirFixup> entries_;
+    bool failed_ = false;
+};
+
+// Check whether a file in the previous snapshot still matches the source, by size
+// and mtime or, with --checksum, by content. The clone carries the snapshot's mode,
+// so a chmod'ed source file counts as changed.
+bool unchanged_in_snapshot(const fs::path& source, const fs::path& previous, const CopyOptions& options) {
+    struct stat src_st, prev_st;
+    if (lstat(source.c_str(), &src_st) != 0 || lstat(previous.c_str(), &prev_st) != 0) {
+        return false;
+    }
+    if (!S_ISREG(src_st.st_mode) || !S_ISREG(prev_st.st_mode) || src_st.st_size != prev_st.st_size ||
+        (src_st.st_mode & 07777) != (prev_st.st_mode & 07777)) {
+        return false;
+    }
+    if (options.checksum) {
+        uint64_t src_hash, prev_hash;
+        return hash_file(source, src_hash) && hash_file(previous, prev_hash) && src_hash == prev_hash;
+    }
+    return src_st.st_mtimespec.tv_sec == prev_st.st_mtimespec.tv_sec &&
+           src_st.st_mtimespec.tv_nsec == prev_st.st_mtimespec.tv_nsec;
+}
+
+// Storage for the names of walked entries. Names are packed NUL-terminated into
+// large chunks instead of costing a heap allocation each, and stay valid for the
+// arena's lifetime.
+class NameArena {
+public:
+    std::string_view intern(const char* name, size_t length) {
+        size_t needed = length + 1;
+        if (chunks_.empty() || used_ + needed > capacity_) {
+            capacity_ = std::max(kChunkSize, needed);
+            chunks_.emplace_back(new char[capacity_]);
+            used_ = 0;
+        }
+        char* slot = chunks_.back().get() + used_;
+        memcpy(slot, name, length);
+        slot[length] = '\0';
+        used_ += needed;
+        bytes_ += needed;
+        return std::string_view(slot, length);
+    }
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    static constexpr size_t kChunkSize = 1 << 20;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    size_t used_ = 0;
+    size_t capacity_ = 0;
+    size_t bytes_ = 0;
+};
+
+// Directories seen by the walk. Each stores its name and a link to its parent, so
+// full paths are only assembled when a file is about to be copied.
+class WalkTree {
+public:
+    WalkTree(const fs::path& source, const fs::path& target, const fs::path& previous)
+        : sources_{source}, target_(target), previous_(previous) {
+        dirs_.push_back({0, std::string_view()}); // the roots
+    }
+
+    // Add a source layer below the existing ones (--layer)
+    void add_layer(const fs::path& root) {
+        sources_.push_back(root);
+        dirs_[0].layers = ~uint32_t(0) >> (32 - sources_.size());
+    }
+
+    size_t layer_count() const { return sources_.size(); }
+
+    // Layers in which a directory exists and is merged, one bit per layer
+    uint32_t layers(uint32_t dir) const { return dirs_[dir].layers; }
+    void set_layers(uint32_t dir, uint32_t layers) { dirs_[dir].layers = layers; }
+
+    uint32_t add_dir(uint32_t parent, std::string_view name) {
+        dirs_.push_back({parent, name});
+        dirs_.back().target_dev = dirs_[parent].target_dev;
+        return uint32_t(dirs_.size() - 1);
+    }
+
+    uint32_t parent(uint32_t dir) const { return dirs_[dir].parent; }
+
+    // Devices of a directory pair and what they support, set by the walk
+    void set_volumes(uint32_t dir, dev_t target_dev, const VolumeCaps& caps) {
+        dirs_[dir].target_dev = target_dev;
+        dirs_[dir].caps = caps;
+    }
+    dev_t target_dev(uint32_t dir) const { return dirs_[dir].target_dev; }
+    const VolumeCaps& caps(uint32_t dir) const { return dirs_[dir].caps; }
+
+    fs::path source_path(uint32_t dir, std::string_view name, uint8_t layer = 0) const {
+        return join(sources_[layer], dir, name);
+    }
+    fs::path target_path(uint32_t dir, std::string_view name) const { return join(target_, dir, name); }
+
+    // Path below the roots
+    fs::path relative_path(uint32_t dir, std::string_view name) const { return join(fs::path(), dir, name); }
+
+    // Path of a directory below the roots, "." for the roots themselves
+    std::string relative_dir(uint32_t dir) const {
+        std::string path = join(fs::path(), dir, "").native();
+        if (!path.empty()) {
+            path.pop_back(); // the separator before the empty name
+        }
+        return path.empty() ? "." : path;
+    }
+
+    // Counterpart in the --reflink-dest snapshot, or empty if there is none
+    fs::path previous_path(uint32_t dir, std::string_view name) const {
+        return previous_.empty() ? fs::path() : join(previous_, dir, name);
+    }
+
+    size_t dir_count() const { return dirs_.size(); }
+
+    NameArena names;
+    std::vector<fs::path> extraneous; // target entries with no source counterpart, for --delete
+
+private:
+    struct Dir {
+        uint32_t parent;
+        uint32_t layers = 1;
+        VolumeCaps caps;
+        std::string_view name;
+        dev_t target_dev = 0;
+
+        Dir(uint32_t parent, std::string_view name) : parent(parent), name(name) {}
+    };
+
+    fs::path join(const fs::path& root, uint32_t dir, std::string_view name) const {
+        thread_local std::vector<std::string_view> parts;
+        parts.clear();
+        for (uint32_t d = dir; d != 0; d = dirs_[d].parent) {
+            parts.push_back(dirs_[d].name);
+        }
+        std::string path = root.string();
+        auto append = [&path](std::string_view part) {
+            if (!path.empty() && path.back() != '/') {
+                path += '/';
+            }
+            path += part;
+        };
+        for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+            append(*it);
+        }
+        append(name);
+        return fs::path(std::move(path));
+    }
+
+    std::vector<fs::path> sources_; // layers, highest priority first
+    fs::path target_;
+    fs::path previous_;
+    std::vector<Dir> dirs_;
+};
+
+// What the walk learned about a file's target from the directory listing
+enum class TargetState : uint8_t {
+    Unknown,  // not listed; look it up
+    Absent,
+    Exists,   // present, times not compared
+    Outdated, // present and older than the source (update mode)
+    Current,  // present and not older than the source (update mode)
+};
+
+// A file found by the walk, copied later by the scheduler
+struct FileJob {
+    std::string_view name; // in the walk's NameArena
+    uint32_t dir;          // WalkTree directory holding the file
+    TargetState target;
+    uint8_t layer;         // source layer holding the file
+    size_t dir_index;      // fix-up record of the containing directory
+    off_t size;
+    off_t physical = 0; // device offset of the first block, with --inode-order
+    bool written = false; // the copy wrote the target; skipped files are not verified
+};
+
+// What a copy does with one file
+enum class PlanAction { Clone, KernelCopy, ByteCopy, SkipUnchanged, Conflict };
+const char* const kPlanActionNames[] = {"reflink", "in-kernel copy", "byte copy", "skip unchanged", "conflict"};
+constexpr size_t kPlanActions = sizeof(kPlanActionNames) / sizeof(kPlanActionNames[0]);
+
+struct FilePlan {
+    PlanAction action = PlanAction::Clone;
+    Engine engine = Engine::Clone;
+    bool backup = false;
+    bool replace = false; // clone beside the outdated target, then rename over it
+    fs::path clone_source;
+};
+
+// Decide what to do with one file. The real run and --dry-run share this; only the
+// dry run passes target_dev to have the engine predicted, since that costs a stat.
+// The target is only looked up when the walk could not tell its state.
+FilePlan plan_file(const fs::path& path, const fs::path& target_path, const fs::path& previous, off_t size,
+                   TargetState state, const CopyOptions& options, const dev_t* target_dev = nullptr) {
+    FilePlan plan;
+    bool exists = state == TargetState::Unknown ? fs::exists(target_path) : state != TargetState::Absent;
+
+    // Update mode: only copy if source file is newer
+    bool current = state == TargetState::Current ||
+                   (state != TargetState::Outdated && exists && options.update && !is_newer(path, target_path));
+    if (options.update && exists && current) {
+        plan.action = PlanAction::SkipUnchanged;
+        return plan;
+    }
+    plan.backup = options.backup && exists;
+    plan.replace = exists && options.update && options.replace_outdated;
+
+    // Unchanged files are cloned from the previous snapshot instead of the source
+    plan.clone_source = path;
+    if (!previous.empty() && unchanged_in_snapshot(path, previous, options)) {
+        plan.clone_source = previous;
+    }
+
+    // clone_file() refuses to replace an existing file
+    if (exists && !plan.replace) {
+        plan.action = PlanAction::Conflict;
+        return plan;
+    }
+
+    if (target_dev) {
+        struct stat st;
+        bool same_volume = !options.store.empty() ||
+                           (stat(plan.clone_source.c_str(), &st) == 0 && st.st_dev == *target_dev);
+        plan.engine = options.engines.select(size);
+        if (plan.engine == Engine::Clone && !same_volume) {
+            plan.engine = uint64_t(size) >= options.direct_threshold ? Engine::Direct : Engine::Buffered;
+        }
+        plan.action = plan.engine == Engine::Clone      ? PlanAction::Clone
+                      : plan.engine == Engine::Copyfile ? PlanAction::KernelCopy
+                                                        : PlanAction::ByteCopy;
+    }
+    return plan;
+}
+
+// Checksums of the files written to the target, collected for --manifest
+class Manifest {
+public:
+    // An empty digest is computed from the target when the manifest is written
+    void add(fs::path relative, std::string digest) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.push_back({std::move(relative), std::move(digest)});
+    }
+
+    // Hash the files whose data was not streamed, in parallel, and write the
+    // manifest sorted by path. Paths are relative to root, so the file can be
+    // checked from there with sha256sum -c or xxhsum -c.
+    bool write(const fs::path& file, const fs::path& root, ManifestHash kind) {
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (entries_[i].digest.empty()) {
+                pending.push_back(i);
+            }
+        }
+        debug_print("Manifest: " + std::to_string(entries_.size() - pending.size()) + " checksums streamed, " +
+                    std::to_string(pending.size()) + " to compute");
+        std::atomic<bool> ok{true};
+        parallel_for(pending.size(), [&](size_t p) {
+            Entry& entry = entries_[pending[p]];
+            if (!digest_file(root / entry.path, kind, entry.digest)) {
+                ok = false;
+            }
+        });
+        std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+
+        std::ofstream out(file, std::ios::trunc);
+        for (const auto& entry : entries_) {
+            // As in sha256sum, names with a backslash or newline are escaped and
+            // the line is marked with a leading backslash
+            const std::string& name = entry.path.native();
+            if (name.find_first_of("\\\n") == std::string::npos) {
+                out << entry.digest << "  " << name << '\n';
+                continue;
+            }
+            std::string escaped;
+            for (char c : name) {
+                escaped += c == '\\' ? "\\\\" : c == '\n' ? "\\n" : std::string(1, c);
+            }
+            out << '\\' << entry.digest << "  " << escaped << '\n';
+        }
+        out.close();
+        if (!out) {
+            print_error("Error writing manifest " + file.string());
+            return false;
+        }
+        return ok;
+    }
+
+private:
+    struct Entry {
+        fs::path path;
+        std::string digest;
+    };
+
+    std::mutex mutex_;
+    std::vector<Entry> entries_;
+};
+Manifest manifest;
+
+// Copy one file found by the walk, honoring update, backup and snapshot options
+bool copy_file_job(FileJob& job, const WalkTree& tree, const CopyOptions& options) {
+    fs::path path = tree.source_path(job.dir, job.name, job.layer);
+    fs::path target_path = tree.target_path(job.dir, job.name);
+    try {
+        FilePlan plan =
+            plan_file(path, target_path, tree.previous_path(job.dir, job.name), job.size, job.target, options);
+        if (plan.action == PlanAction::SkipUnchanged) {
+            debug_print("Skipping file (not newer): " + path.string());
+            progress.bytes_skipped.fetch_add(job.size, std::memory_order_relaxed);
+            progress.files.fetch_add(1, std::memory_order_relaxed);
+            if (!options.manifest.empty()) {
+                manifest.add(tree.relative_path(job.dir, job.name), std::string());
+            }
+            return true;
+        }
+
+        if (plan.backup) {
+            debug_print("Backing up file: " + target_path.string());
+            fs::copy_file(target_path, target_path.string() + "~", fs::copy_options::overwrite_existing);
+        }
+
+        if (plan.clone_source != path) {
+            debug_print("Unchanged since previous snapshot: " + path.string());
+        }
+
+        uint64_t copied_before = thread_bytes_copied;
+        StreamDigest digest(options.manifest_hash);
+        if (!options.manifest.empty()) {
+            stream_digest = &digest;
+        }
+        fs::path destination = target_path;
+        if (plan.replace) {
+            destination = target_path.parent_path() / (".cf-update." + target_path.filename().string());
+            unlink(destination.c_str()); // left over from an interrupted run
+        }
+        // Clones from a previous snapshot or a lower layer may come from another
+        // volume. A file in the previous snapshot only counts as unchanged at the
+        // same size, so the walk's size holds either way.
+        bool cloned = clone_entry(plan.clone_source, destination, options,
+                                  plan.clone_source == path && tree.layer_count() == 1 ? &tree.caps(job.dir) : nullptr,
+                                  job.size);
+        stream_digest = nullptr;
+        if (!cloned) {
+            return false;
+        }
+        if (plan.replace && rename(destination.c_str(), target_path.c_str()) != 0) {
+            print_error("Error replacing " + target_path.string());
+            unlink(destination.c_str());
+            return false;
+        }
+        if (!options.manifest.empty()) {
+            manifest.add(tree.relative_path(job.dir, job.name),
+                         digest.length() == uint64_t(job.size) ? digest.hex() : std::string());
+        }
+        uint64_t copied = thread_bytes_copied - copied_before;
+        if (uint64_t(job.size) > copied) {
+            progress.bytes_cloned.fetch_add(job.size - copied, std::memory_order_relaxed);
+        }
+        progress.files.fetch_add(1, std::memory_order_relaxed);
+        job.written = true;
+
+        // Preserve permissions if required
+        if (options.preserve_permissions) {
+            debug_print("Preserving permissions for: " + target_path.string());
+            fs::permissions(target_path, fs::status(path).permissions());
+        }
+    } catch (const fs::filesystem_error& e) {
+        print_error(e.what());
+        return false;
+    }
+    return true;
+}
+
+// A raw directory entry as returned by readdir
+struct DirEntry {
+    std::string_view name; // in the walk's NameArena
+    ino_t ino;
+    unsigned char type;
+    uint8_t layer = 0; // source layer the entry comes from (--layer)
+};
+
+// Read a directory's entries, excluding . and .., interning their names
+bool list_directory(DIR* handle, const fs::path& dir, NameArena& names, std::vector<DirEntry>& entries) {
+    errno = 0;
+    while (struct dirent* entry = readdir(handle)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            entries.push_back({names.intern(entry->d_name, strlen(entry->d_name)), entry->d_ino, entry->d_type});
+        }
+    }
+    if (errno != 0) {
+        print_error("Error reading directory " + dir.string());
+        return false;
+    }
+    return true;
+}
+
+// Whiteouts, as in OCI image layers: ".wh.NAME" in a layer hides NAME in the
+// layers below it, and ".wh..wh..opq" hides everything below in its directory
+constexpr std::string_view kWhiteoutPrefix = ".wh.";
+constexpr std::string_view kOpaqueMarker = ".wh..wh..opq";
+
+// List one directory across source layers, highest priority first, into entries
+// and report for each entry the layers a subdirectory merges (one bit per layer).
+// Each name comes from the highest layer that has it; a directory also merges the
+// same-named directories of lower layers until a layer has something else there
+// or a whiteout hides them.
+bool list_layers(WalkTree& tree, uint32_t dir, const std::vector<std::pair<uint8_t, DIR*>>& layers,
+                 std::vector<DirEntry>& entries, std::vector<uint32_t>& merged) {
+    constexpr size_t hidden = std::numeric_limits<size_t>::max();
+    std::unordered_map<std::string_view, size_t> seen; // name to entry index, or hidden
+    std::vector<bool> closed;                          // no more layers merge into the entry
+    for (const auto& layer : layers) {
+        std::vector<DirEntry> listed;
+        if (!list_directory(layer.second, tree.source_path(dir, "", layer.first), tree.names, listed)) {
+            return false;
+        }
+        bool opaque = false;
+        for (auto& entry : listed) {
+            if (entry.name.compare(0, kWhiteoutPrefix.size(), kWhiteoutPrefix) == 0) {
+                continue; // applied below, once this layer's own entries are in
+            }
+            struct stat st;
+            bool is_dir = entry.type == DT_DIR ||
+                          ((entry.type == DT_UNKNOWN || entry.type == DT_LNK) &&
+                           fstatat(dirfd(layer.second), entry.name.data(), &st, 0) == 0 && S_ISDIR(st.st_mode));
+            auto it = seen.find(entry.name);
+            if (it == seen.end()) {
+                entry.layer = layer.first;
+                seen.emplace(entry.name, entries.size());
+                entries.push_back(entry);
+                merged.push_back(is_dir ? 1u << layer.first : 0);
+                closed.push_back(!is_dir);
+            } else if (it->second != hidden && !closed[it->second]) {
+                if (is_dir) {
+                    merged[it->second] |= 1u << layer.first;
+                } else {
+                    closed[it->second] = true;
+                }
+            }
+        }
+        for (const auto& entry : listed) {
+            if (entry.name == kOpaqueMarker) {
+                opaque = true;
+            } else if (entry.name.compare(0, kWhiteoutPrefix.size(), kWhiteoutPrefix) == 0) {
+                auto it = seen.emplace(entry.name.substr(kWhiteoutPrefix.size()), hidden).first;
+                if (it->second != hidden) {
+                    closed[it->second] = true;
+                }
+            }
+        }
+        if (opaque) {
+            break;
+        }
+    }
+    return true;
+}
+
+// One level of the walk's stack of ignore files. Frames are only pushed for
+// directories that have rules; each entry is checked from the innermost frame
+// outwards and the first frame with a matching rule decides.
+struct IgnoreFrame {
+    const IgnoreFrame* parent;
+    IgnoreRules rules;
+    size_t base_length; // length of the frame directory's source path, see path_length()
+};
+
+// Length of a directory path without trailing separators, so that a source given
+// as src/ measures the same as src
+size_t path_length(const fs::path& dir) {
+    const std::string& text = dir.native();
+    size_t length = text.size();
+    while (length > 1 && text[length - 1] == '/') {
+        length--;
+    }
+    return length;
+}
+
+// Whether the ignore stack excludes an entry of the directory at source
+bool ignored(const IgnoreFrame* frame, const fs::path& source, std::string_view name, bool is_dir) {
+    for (; frame; frame = frame->parent) {
+        std::string relative;
+        if (frame->rules.has_anchored()) {
+            const std::string& dir = source.native();
+            size_t start = frame->base_length;
+            while (start < dir.size() && dir[start] == '/') {
+                start++;
+            }
+            size_t length = path_length(source);
+            if (length > start) {
+                relative.assign(dir, start, length - start);
+                relative += '/';
+            }
+            relative += name;
+        }
+        int verdict = frame->rules.match(name, relative, is_dir);
+        if (verdict >= 0) {
+            return verdict == 1;
+        }
+    }
+    return false;
+}
+
+// Order-independent summary of one directory entry: its name, and for files the
+// mode, size and modification time. A directory's summary is the sum over its
+// entries, so it changes when any of its files or the set of names does.
+uint64_t summarize_entry(std::string_view name, const struct stat* st) {
+    Xxh64 hasher;
+    hasher.update(reinterpret_cast<const unsigned char*>(name.data()), name.size());
+    uint64_t fields[4] = {};
+    if (st) {
+        fields[0] = st->st_mode;
+        fields[1] = uint64_t(st->st_size);
+        fields[2] = uint64_t(st->st_mtimespec.tv_sec);
+        fields[3] = uint64_t(st->st_mtimespec.tv_nsec);
+    }
+    hasher.update(reinterpret_cast<const unsigned char*>(fields), sizeof(fields));
+    return hasher.digest();
+}
+
+// Per-directory summaries kept in a sidecar file between runs (--index). Each
+// line holds a directory's summary, its target's modification time once the copy
+// had finished, and its path relative to the roots:
+//   <summary> <seconds>.<nanoseconds> <path>
+// The target time catches entries added or removed in the target by anything else.
+class SummaryIndex {
+public:
+    // A missing index reads as empty
+    bool load(const fs::path& file) {
+        std::ifstream in(file);
+        if (!in) {
+            return errno == ENOENT;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            Record record;
+            char* end = nullptr;
+            record.summary = strtoull(line.c_str(), &end, 16);
+            if (*end != ' ') {
+                continue;
+            }
+            record.seconds = strtoll(end + 1, &end, 10);
+            if (*end != '.') {
+                continue;
+            }
+            record.nanoseconds = strtol(end + 1, &end, 10);
+            if (*end != ' ') {
+                continue;
+            }
+            stored_[std::string(end + 1)] = record;
+        }
+        return true;
+    }
+
+    bool unchanged(const std::string& dir, uint64_t summary, const fs::path& target) const {
+        auto it = stored_.find(dir);
+        struct stat st;
+        return it != stored_.end() && it->second.summary == summary && stat(target.c_str(), &st) == 0 &&
+               st.st_mtimespec.tv_sec == it->second.seconds && st.st_mtimespec.tv_nsec == it->second.nanoseconds;
+    }
+
+    void record(std::string dir, uint64_t summary) { walked_.emplace_back(std::move(dir), summary); }
+
+    // Write the summaries of this walk with the target times as they are now
+    bool save(const fs::path& file, const fs::path& target) {
+        fs::path temporary = file.string() + ".tmp";
+        std::ofstream out(temporary, std::ios::trunc);
+        for (const auto& dir : walked_) {
+            struct stat st;
+            if (stat((target / dir.first).c_str(), &st) != 0) {
+                continue;
+            }
+            char line[64];
+            snprintf(line, sizeof(line), "%016llx %lld.%09ld ", (unsigned long long)dir.second,
+                     (long long)st.st_mtimespec.tv_sec, long(st.st_mtimespec.tv_nsec));
+            out << line << dir.first << '\n';
+        }
+        out.close();
+        if (!out || rename(temporary.c_str(), file.c_str()) != 0) {
+            print_error("Error writing index " + file.string());
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Record {
+        uint64_t summary;
+        long long seconds;
+        long nanoseconds;
+    };
+
+    std::unordered_map<std::string, Record> stored_;
+    std::vector<std::pair<std::string, uint64_t>> walked_;
+};
+SummaryIndex summary_index;
+
+// A target directory's entries, read once per directory so the walk can tell which
+// files already exist without a lookup per file. Only entries present on both
+// sides are stat'ed, relative to the open directory.
+class TargetListing {
+public:
+    ~TargetListing() {
+        if (handle_) {
+            closedir(handle_);
+        }
+    }
+
+    // A missing directory reads as empty
+    bool read(const fs::path& dir) {
+        handle_ = opendir(dir.c_str());
+        if (!handle_) {
+            if (errno == ENOENT) {
+                return true;
+            }
+            print_error("Error opening directory " + dir.string());
+            return false;
+        }
+        errno = 0;
+        while (struct dirent* entry = readdir(handle_)) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                storage_.emplace_back(entry->d_name);
+                names_.insert(storage_.back());
+            }
+        }
+        if (errno != 0) {
+            print_error("Error reading directory " + dir.string());
+            return false;
+        }
+        return true;
+    }
+
+    // In update mode the times are compared as is_newer() would, following symlinks
+    TargetState state(std::string_view name, const struct stat* source_st, bool update) const {
+        if (!names_.count(name)) {
+            return TargetState::Absent;
+        }
+        struct stat st;
+        if (!update || !source_st) {
+            return TargetState::Exists;
+        }
+        if (fstatat(dirfd(handle_), name.data(), &st, 0) != 0) {
+            return TargetState::Unknown;
+        }
+        const struct timespec& a = source_st->st_mtimespec;
+        const struct timespec& b = st.st_mtimespec;
+        bool newer = a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+        return newer ? TargetState::Outdated : TargetState::Current;
+    }
+
+    const std::deque<std::string>& names() const { return storage_; }
+
+    // Device of the listed directory, if it could be opened
+    bool device(dev_t& dev) const {
+        struct stat st;
+        if (!handle_ || fstat(dirfd(handle_), &st) != 0) {
+            return false;
+        }
+        dev = st.st_dev;
+        return true;
+    }
+
+private:
+    DIR* handle_ = nullptr;
+    std::deque<std::string> storage_; // stable storage for the views in names_
+    std::unordered_set<std::string_view> names_;
+};
+
+// Record the target entries that have no counterpart among the source entries.
+// Entries the filters exclude are left alone, as in rsync.
+void find_extraneous(WalkTree& tree, const fs::path& source, const fs::path& target, const TargetListing& listing,
+                     const std::vector<DirEntry>& entries, const CopyOptions& options, const IgnoreFrame* ignores) {
+    std::unordered_set<std::string_view> present;
+    present.reserve(entries.size());
+    for (const auto& entry : entries) {
+        present.insert(entry.name);
+    }
+    for (const std::string& name : listing.names()) {
+        if (present.count(name)) {
+            continue;
+        }
+        // Type is unknown without a stat; directory-only rules are tried too
+        if (options.filter.has_rules() &&
+            (!options.filter.allows_name(name, false) || !options.filter.allows_name(name, true))) {
+            continue;
+        }
+        if (ignores && (ignored(ignores, source, name, false) || ignored(ignores, source, name, true))) {
+            continue;
+        }
+        debug_print("Extraneous: " + (target / name).string());
+        tree.extraneous.push_back(target / name);
+    }
+}
+
+// Walk one directory level, creating target directories and collecting files to
+// copy. Files are stat'ed relative to the open directory and recorded as a name
+// plus directory index, so the walk itself does not build a path per file.
+bool walk_tree(WalkTree& tree, uint32_t dir, const fs::path& source, const fs::path& target, const CopyOptions& options,
+               DirFixupTable* fixups, size_t dir_index, std::vector<FileJob>& jobs,
+               const IgnoreFrame* ignores = nullptr, bool fresh = false) {
+    debug_print("Listing source directory: " + source.string());
+    // With --layer, the directory is listed in every layer that merges it
+    std::vector<std::pair<uint8_t, DIR*>> layers;
+    std::vector<std::unique_ptr<DIR, int (*)(DIR*)>> closers;
+    int layer_fds[32] = {};
+    for (uint8_t layer = 0; layer < tree.layer_count(); layer++) {
+        if (!(tree.layers(dir) & (1u << layer))) {
+            continue;
+        }
+        fs::path path = layer == 0 ? source : tree.source_path(dir, "", layer);
+        DIR* handle = opendir(path.c_str());
+        if (!handle) {
+            print_error("Error opening directory " + path.string());
+            return false;
+        }
+        closers.emplace_back(handle, closedir);
+        layers.emplace_back(layer, handle);
+        layer_fds[layer] = dirfd(handle);
+    }
+    std::vector<DirEntry> entries;
+    std::vector<uint32_t> merged;
+    if (tree.layer_count() == 1 ? !list_directory(layers[0].second, source, tree.names, entries)
+                                : !list_layers(tree, dir, layers, entries, merged)) {
+        return false;
+    }
+    // Inode order approximates on-disk order of the inode table, turning the stats
+    // below into a forward sweep on rotational disks and cold caches
+    if (options.inode_order) {
+        if (merged.empty()) {
+            std::sort(entries.begin(), entries.end(), [](const DirEntry& a, const DirEntry& b) { return a.ino < b.ino; });
+        }
+    }
+
+    int dfd = dirfd(layers[0].second);
+
+    // Push this directory's ignore files, if it has any
+    std::unique_ptr<IgnoreFrame> frame;
+    if (options.gitignore) {
+        bool found = false;
+        for (const auto& entry : entries) {
+            if (entry.name == ".gitignore" || entry.name == ".ignore") {
+                found = true;
+            }
+        }
+        if (found) {
+            // .ignore is read last so its rules take precedence
+            frame.reset(new IgnoreFrame{ignores, {}, path_length(source)});
+            frame->rules.read(dfd, ".gitignore");
+            frame->rules.read(dfd, ".ignore");
+            frame->rules.compile();
+            if (!frame->rules.empty()) {
+                debug_print("Using ignore rules in: " + source.string());
+                ignores = frame.get();
+            }
+        }
+    }
+
+    // Sort the entries into files and subdirectories, applying the filters, and
+    // summarize them for the --index
+    struct FoundFile {
+        std::string_view name;
+        uint8_t layer;
+        bool have_stat;
+        struct stat st;
+    };
+    struct FoundDir {
+        std::string_view name;
+        uint8_t layer;
+        uint32_t layers;
+    };
+    std::vector<FoundFile> files;
+    std::vector<FoundDir> subdirs;
+    uint64_t summary = 0;
+    for (size_t e = 0; e < entries.size(); e++) {
+        const DirEntry& entry = entries[e];
+        int efd = layer_fds[entry.layer];
+        // Symlinks to directories are followed, as before
+        struct stat st;
+        bool have_stat = false;
+        bool is_dir = entry.type == DT_DIR;
+        if (entry.type == DT_UNKNOWN || entry.type == DT_LNK) {
+            have_stat = fstatat(efd, entry.name.data(), &st, 0) == 0;
+            is_dir = have_stat && S_ISDIR(st.st_mode);
+        }
+
+        // Filtered by name before anything else, so excluded subtrees are never opened
+        if (options.filter.has_rules() && !options.filter.allows_name(entry.name, is_dir)) {
+            if (debug_mode) {
+                debug_print("Excluded: " + (source / entry.name).string());
+            }
+            continue;
+        }
+        if (ignores && ignored(ignores, source, entry.name, is_dir)) {
+            if (debug_mode) {
+                debug_print("Ignored: " + (source / entry.name).string());
+            }
+            continue;
+        }
+
+        if (is_dir) {
+            subdirs.push_back({entry.name, entry.layer, merged.empty() ? 1u : merged[e]});
+            summary += summarize_entry(entry.name, nullptr);
+            continue;
+        }
+        if (debug_mode) {
+            debug_print("Found file: " + (source / entry.name).string());
+        }
+        if (!have_stat) {
+            have_stat = fstatat(efd, entry.name.data(), &st, 0) == 0;
+        }
+        if (options.filter.has_limits() && have_stat && !options.filter.allows_file(st)) {
+            continue;
+        }
+        summary += summarize_entry(entry.name, have_stat ? &st : nullptr);
+        files.push_back({entry.name, entry.layer, have_stat, st});
+    }
+
+    // In update mode, a directory whose files are as they were when the index was
+    // written, with its target untouched since, has nothing to copy
+    std::string relative;
+    bool unchanged = false;
+    if (!options.index.empty()) {
+        relative = tree.relative_dir(dir);
+        unchanged = options.update && !fresh && summary_index.unchanged(relative, summary, target);
+        if (unchanged) {
+            debug_print("Unchanged since the index was written: " + source.string());
+        }
+        summary_index.record(relative, summary);
+    }
+
+    // Directories created by this walk are known to be empty
+    TargetListing listing;
+    if (!fresh && (!unchanged || options.mirror)) {
+        debug_print("Listing target directory: " + target.string());
+        if (!listing.read(target)) {
+            return false;
+        }
+        if (options.mirror) {
+            find_extraneous(tree, source, target, listing, entries, options, ignores);
+        }
+    }
+
+    // Volume capabilities for this directory's files. A directory created by the
+    // walk is on its parent's target volume, which add_dir() carried over.
+    struct stat dir_st;
+    dev_t target_dev = tree.target_dev(dir);
+    if (!listing.device(target_dev) && dir == 0 && stat(target.c_str(), &dir_st) == 0) {
+        target_dev = dir_st.st_dev;
+    }
+    if (fstat(dfd, &dir_st) == 0) {
+        tree.set_volumes(dir, target_dev, volume_caps.get(dir_st.st_dev, target_dev, source, target));
+    }
+
+    if (!unchanged) {
+        for (const auto& file : files) {
+            TargetState target_state =
+                fresh ? TargetState::Absent
+                      : listing.state(file.name, file.have_stat ? &file.st : nullptr, options.update);
+            if (fixups) {
+                fixups->add_pending(dir_index);
+            }
+            jobs.push_back(
+                {file.name, dir, target_state, file.layer, dir_index, file.have_stat ? file.st.st_size : 0});
+        }
+    } else if (!options.manifest.empty()) {
+        // The files are still part of the target; hash them from there
+        for (const auto& file : files) {
+            manifest.add(tree.relative_path(dir, file.name), std::string());
+        }
+    }
+
+    try {
+        for (const auto& subdir : subdirs) {
+            std::string_view name = subdir.name;
+            fs::path path = tree.layer_count() == 1 ? source / name : tree.source_path(dir, name, subdir.layer);
+            fs::path target_path = target / name;
+            debug_print("Found directory: " + path.string());
+            bool created = false;
+            if (!options.dry_run) {
+                debug_print("Creating directory: " + target_path.string());
+                created = fs::create_directory(target_path);
+            }
+            if (options.shallow && !created) {
+                continue;
+            }
+            size_t child_index = DirFixupTable::npos;
+            if (fixups) {
+                child_index = fixups->record(path, target_path, dir_index);
+            }
+            uint32_t child = tree.add_dir(dir, name);
+            tree.set_layers(child, subdir.layers);
+            progress.dirs.fetch_add(1, std::memory_order_relaxed);
+            bool ok = walk_tree(tree, child, path, target_path, options, fixups, child_index, jobs, ignores, created);
+            if (fixups) {
+                fixups->complete(child_index);
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        print_error(e.what());
+        return false;
+    }
+    return true;
+}
+
+// Device offset of a file's first block, or the largest offset if unknown
+off_t physical_offset(const fs::path& path) {
+    off_t unknown = std::numeric_limits<off_t>::max();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return unknown;
+    }
+    struct log2phys l2p = {};
+    l2p.l2p_contigbytes = 1;
+    l2p.l2p_devoffset = 0; // file offset to translate
+    off_t offset = fcntl(fd, F_LOG2PHYS_EXT, &l2p) == 0 ? l2p.l2p_devoffset : unknown;
+    close(fd);
+    return offset;
+}
+
+// Files below this size are copied in batches; per-file dispatch would dominate
+constexpr off_t kTinyFile = 64 << 10;
+constexpr size_t kTinyBatch = 64;
+
+// Copy the walk's files on a worker pool. Larger files are started first, longest
+// first, so one huge file started last cannot stretch the run; tiny files follow
+// in batches that fill the remaining gaps with one dispatch each.
+//
+// With --inode-order, files are instead copied in order of their first block on
+// the device so that data reads sweep the disk rather than seek across it.
+bool run_file_jobs(std::vector<FileJob>& jobs, const WalkTree& tree, const CopyOptions& options, DirFixupTable* fixups,
+                   bool walk_ok) {
+    auto tiny = jobs.begin();
+    if (options.inode_order) {
+        for (auto& job : jobs) {
+            job.physical = physical_offset(tree.source_path(job.dir, job.name, job.layer));
+        }
+        std::stable_sort(jobs.begin(), jobs.end(), [](const FileJob& a, const FileJob& b) { return a.physical < b.physical; });
+    } else {
+        tiny = std::stable_partition(jobs.begin(), jobs.end(), [](const FileJob& job) { return job.size >= kTinyFile; });
+        std::sort(jobs.begin(), tiny, [](const FileJob& a, const FileJob& b) { return a.size > b.size; });
+    }
+
+    // Each task is a run of consecutive jobs: one for a large file, a batch for tiny ones
+    std::vector<std::pair<size_t, size_t>> tasks;
+    size_t first_tiny = tiny - jobs.begin();
+    for (size_t i = 0; i < first_tiny; i++) {
+        tasks.emplace_back(i, i + 1);
+    }
+    for (size_t i = first_tiny; i < jobs.size(); i += kTinyBatch) {
+        tasks.emplace_back(i, std::min(i + kTinyBatch, jobs.size()));
+    }
+    debug_print("Scheduling " + std::to_string(jobs.size()) + " files as " + std::to_string(tasks.size()) + " tasks");
+
+    // Like the sequential walk, stop copying after the first failure; fix-ups are
+    // still completed so directories that were written get their metadata
+    std::atomic<bool> ok{walk_ok};
+    parallel_for(tasks.size(), [&](size_t t) {
+        for (size_t i = tasks[t].first; i < tasks[t].second; i++) {
+            if (ok && !copy_file_job(jobs[i], tree, options)) {
+                ok = false;
+            }
+            if (fixups) {
+                fixups->complete(jobs[i].dir_index);
+            }
+        }
+    }, options.jobs);
+    return ok;
+}
+
+// Device of path, or of its nearest existing ancestor if it does not exist yet
+dev_t nearest_device(fs::path path) {
+    struct stat st;
+    while (stat(path.empty() ? "." : path.c_str(), &st) != 0 && !path.empty() && path != path.root_path()) {
+        path = path.parent_path();
+    }
+    return st.st_dev;
+}
+
+// Plan every job without writing anything and print counts, bytes and, if the
+// target filesystem has been calibrated, an estimated duration
+void report_plan(const std::vector<FileJob>& jobs, const WalkTree& tree, const CopyOptions& options, size_t dirs) {
+    dev_t target_dev = nearest_device(tree.target_path(0, ""));
+    std::vector<FilePlan> plans(jobs.size());
+    parallel_for(jobs.size(), [&](size_t i) {
+        const FileJob& job = jobs[i];
+        try {
+            plans[i] = plan_file(tree.source_path(job.dir, job.name, job.layer), tree.target_path(job.dir, job.name),
+                                 tree.previous_path(job.dir, job.name), job.size, job.target, options, &target_dev);
+        } catch (const fs::filesystem_error& e) {
+            print_error(e.what());
+            plans[i].action = PlanAction::Conflict;
+        }
+    }, options.jobs);
+
+    uint64_t counts[kPlanActions] = {}, bytes[kPlanActions] = {};
+    uint64_t backups = 0, backup_bytes = 0;
+    double micros = 0;
+    bool estimated = options.engines.calibrated;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        size_t action = size_t(plans[i].action);
+        counts[action]++;
+        bytes[action] += jobs[i].size;
+        if (plans[i].backup) {
+            backups++;
+            backup_bytes += jobs[i].size;
+        }
+        if (plans[i].action <= PlanAction::ByteCopy) {
+            double cost = options.engines.estimate_micros(plans[i].engine, jobs[i].size);
+            estimated = estimated && cost > 0;
+            micros += cost;
+        }
+    }
+
+    std::cout << "Dry run: " << jobs.size() << " files in " << dirs << " directories" << std::endl;
+    auto print_row = [](const char* name, uint64_t count, uint64_t size) {
+        char row[96];
+        snprintf(row, sizeof(row), "  %-15s %10llu files  %12s", name, (unsigned long long)count, format_bytes(size).c_str());
+        std::cout << row << std::endl;
+    };
+    for (size_t a = 0; a < kPlanActions; a++) {
+        print_row(kPlanActionNames[a], counts[a], bytes[a]);
+    }
+    print_row("backup", backups, backup_bytes);
+    if (estimated) {
+        size_t workers = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "Estimated duration: " << micros / 1e6 / workers << " s on " << workers << " workers ("
+                  << micros / 1e6 << " s serial)" << std::endl;
+    } else {
+        std::cout << "No estimated duration: run --calibrate on the target filesystem first" << std::endl;
+    }
+}
+
+// Whether target's data is provably the same blocks as source's: every extent of
+// target must map to the same device offset as the matching range of source.
+// Holes and unmapped ranges cannot be proven and fail the check.
+bool shares_extents(int source_fd, int target_fd, off_t size) {
+    struct stat source_st, target_st;
+    if (fstat(source_fd, &source_st) != 0 || fstat(target_fd, &target_st) != 0 ||
+        source_st.st_dev != target_st.st_dev || size == 0) {
+        return false;
+    }
+    for (off_t offset = 0; offset < size;) {
+        struct log2phys source_l2p = {}, target_l2p = {};
+        source_l2p.l2p_contigbytes = target_l2p.l2p_contigbytes = size - offset;
+        source_l2p.l2p_devoffset = target_l2p.l2p_devoffset = offset;
+        if (fcntl(source_fd, F_LOG2PHYS_EXT, &source_l2p) != 0 || fcntl(target_fd, F_LOG2PHYS_EXT, &target_l2p) != 0 ||
+            source_l2p.l2p_devoffset != target_l2p.l2p_devoffset) {
+            return false;
+        }
+        off_t run = std::min(source_l2p.l2p_contigbytes, target_l2p.l2p_contigbytes);
+        if (run <= 0) {
+            return false;
+        }
+        offset += run;
+    }
+    return true;
+}
+
+// Files at least this large have their two sides hashed concurrently
+constexpr off_t kVerifySplit = 1 << 20;
+
+enum class VerifyResult { Shared, Matched, Mismatched, Failed };
+
+// Check one copied file against its source: shared extents when the copy was a
+// clone, otherwise XXH64 of both sides
+VerifyResult verify_file(const fs::path& source, const fs::path& target, off_t size) {
+    int source_fd = open(source.c_str(), O_RDONLY);
+    if (source_fd < 0) {
+        print_error("Error opening " + source.string());
+        return VerifyResult::Failed;
+    }
+    int target_fd = open(target.c_str(), O_RDONLY);
+    if (target_fd < 0) {
+        print_error("Error opening " + target.string());
+        close(source_fd);
+        return VerifyResult::Failed;
+    }
+    VerifyResult result = VerifyResult::Failed;
+    struct stat st;
+    if (fstat(target_fd, &st) == 0 && st.st_size != size) {
+        result = VerifyResult::Mismatched;
+    } else if (shares_extents(source_fd, target_fd, size)) {
+        result = VerifyResult::Shared;
+    } else {
+        uint64_t source_hash = 0, target_hash = 0;
+        bool source_ok, target_ok;
+        if (size >= kVerifySplit) {
+            std::thread reader([&] { target_ok = hash_fd(target_fd, target_hash); });
+            source_ok = hash_fd(source_fd, source_hash);
+            reader.join();
+        } else {
+            source_ok = hash_fd(source_fd, source_hash);
+            target_ok = hash_fd(target_fd, target_hash);
+        }
+        if (!source_ok || !target_ok) {
+            print_error("Error reading " + (source_ok ? target : source).string());
+        } else {
+            result = source_hash == target_hash ? VerifyResult::Matched : VerifyResult::Mismatched;
+        }
+    }
+    close(source_fd);
+    close(target_fd);
+    return result;
+}
+
+// Verify every file the walk copied, largest first, and report mismatches
+bool verify_jobs(std::vector<FileJob>& jobs, const WalkTree& tree) {
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const FileJob& job) { return !job.written; }), jobs.end());
+    debug_print("Verifying " + std::to_string(jobs.size()) + " files");
+    std::sort(jobs.begin(), jobs.end(), [](const FileJob& a, const FileJob& b) { return a.size > b.size; });
+    std::atomic<uint64_t> counts[4] = {};
+    parallel_for(jobs.size(), [&](size_t i) {
+        const FileJob& job = jobs[i];
+        fs::path target = tree.target_path(job.dir, job.name);
+        VerifyResult result = verify_file(tree.source_path(job.dir, job.name, job.layer), target, job.size);
+        counts[size_t(result)].fetch_add(1, std::memory_order_relaxed);
+        if (result == VerifyResult::Mismatched) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Mismatch: " << target.string() << std::endl;
+        }
+    });
+    uint64_t mismatched = counts[size_t(VerifyResult::Mismatched)];
+    uint64_t failed = counts[size_t(VerifyResult::Failed)];
+    std::cout << "Verified " << jobs.size() << " files: " << counts[size_t(VerifyResult::Shared)]
+              << " share extents with the source, " << counts[size_t(VerifyResult::Matched)] << " matched by hash, "
+              << mismatched << " mismatched";
+    if (failed > 0) {
+        std::cout << ", " << failed << " could not be read";
+    }
+    std::cout << std::endl;
+    return mismatched == 0 && failed == 0;
+}
+
+// Extraneous entries expanded for deletion: files (and symlinks) first, then
+// directories, which are removed deepest level first once they are empty
+struct DeletionPlan {
+    std::vector<fs::path> files;
+    std::vector<std::pair<size_t, fs::path>> dirs; // depth below the extraneous entry, path
+};
+
+// Add path and, if it is a real directory, everything below it. Symlinks are
+// removed, never followed.
+bool plan_deletion(const fs::path& path, size_t depth, DeletionPlan& plan) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        print_error("Error reading " + path.string());
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        plan.files.push_back(path);
+        return true;
+    }
+    plan.dirs.emplace_back(depth, path);
+    DIR* handle = opendir(path.c_str());
+    if (!handle) {
+        print_error("Error opening directory " + path.string());
+        return false;
+    }
+    bool ok = true;
+    while (struct dirent* entry = readdir(handle)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        fs::path child = path / entry->d_name;
+        if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
+            ok = plan_deletion(child, depth + 1, plan) && ok;
+        } else {
+            plan.files.push_back(child);
+        }
+    }
+    closedir(handle);
+    return ok;
+}
+
+// Remove the walk's extraneous target entries. Files are unlinked in parallel,
+// then directories bottom-up, one depth level at a time. Nothing is removed if
+// the total would exceed options.max_delete.
+bool delete_extraneous(const std::vector<fs::path>& extraneous, const CopyOptions& options) {
+    DeletionPlan plan;
+    bool ok = true;
+    for (const auto& path : extraneous) {
+        ok = plan_deletion(path, 0, plan) && ok;
+    }
+    uint64_t total = plan.files.size() + plan.dirs.size();
+    if (options.dry_run) {
+        std::cout << "  delete          " << total << " entries (" << plan.files.size() << " files, "
+                  << plan.dirs.size() << " directories)" << std::endl;
+        return ok;
+    }
+    if (!ok) {
+        std::cerr << "Not deleting anything: the target could not be fully listed" << std::endl;
+        return false;
+    }
+    if (total > options.max_delete) {
+        std::cerr << "Not deleting " << total << " extraneous entries: more than --max-delete " << options.max_delete
+                  << std::endl;
+        return false;
+    }
+
+    std::atomic<bool> deleted{true};
+    parallel_for(plan.files.size(), [&](size_t i) {
+        debug_print("Deleting: " + plan.files[i].string());
+        if (unlinkat(AT_FDCWD, plan.files[i].c_str(), 0) != 0 && errno != ENOENT) {
+            print_error("Error deleting " + plan.files[i].string());
+            deleted = false;
+        }
+    }, options.jobs);
+    std::sort(plan.dirs.begin(), plan.dirs.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (size_t level = 0; level < plan.dirs.size();) {
+        size_t end = level;
+        while (end < plan.dirs.size() && plan.dirs[end].first == plan.dirs[level].first) {
+            end++;
+        }
+        parallel_for(end - level, [&](size_t i) {
+            const fs::path& dir = plan.dirs[level + i].second;
+            debug_print("Deleting directory: " + dir.string());
+            if (unlinkat(AT_FDCWD, dir.c_str(), AT_REMOVEDIR) != 0 && errno != ENOENT) {
+                print_error("Error deleting " + dir.string());
+                deleted = false;
+            }
+        }, options.jobs);
+        level = end;
+    }
+    if (total > 0) {
+        std::cout << "Deleted " << total << " extraneous entries" << std::endl;
+    }
+    return deleted;
+}
+
+// APFS clones a whole directory hierarchy with one clonefile() call, in time
+// independent of its size. That matches the per-file walk only when the target
+// does not exist yet and nothing is filtered, compared or recorded per file.
+bool whole_tree_clone_possible(const CopyOptions& options) {
+    return !options.filter.active() && !options.gitignore && !options.update && !options.mirror && !options.dry_run &&
+           !options.verify && options.store.empty() && options.reflink_dest.empty() && options.manifest.empty() &&
+           options.index.empty() && options.layers.empty();
+}
+
+// Whether the directory name in parent_fd contains a symlink anywhere below it.
+// The walk follows symlinks while clonefile() clones them as links, so a tree
+// with any is copied by the walk to give the same result either way. Directories
+// that cannot be read count as containing one, leaving the decision to the walk.
+bool tree_has_symlinks(int parent_fd, const char* name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        return true;
+    }
+    DIR* handle = fdopendir(fd);
+    if (!handle) {
+        close(fd);
+        return true;
+    }
+    bool found = false;
+    while (struct dirent* entry = readdir(handle)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(handle), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                found = true;
+                break;
+            }
+            type = S_ISLNK(st.st_mode) ? DT_LNK : S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (type == DT_LNK || (type == DT_DIR && tree_has_symlinks(dirfd(handle), entry->d_name))) {
+            found = true;
+            break;
+        }
+    }
+    closedir(handle);
+    return found;
+}
+
+enum class TreeClone { Done, Unavailable, Failed };
+
+// Clone source to the not yet existing target in one call. Unavailable means the
+// walk should copy the tree instead.
+TreeClone clone_tree(const fs::path& source, const fs::path& target) {
+    fs::path parent = target.parent_path().empty() ? fs::path(".") : target.parent_path();
+    struct stat source_st, parent_st;
+    if (stat(source.c_str(), &source_st) != 0 || stat(parent.c_str(), &parent_st) != 0 ||
+        source_st.st_dev != parent_st.st_dev) {
+        debug_print("Whole-tree clone not possible across volumes");
+        return TreeClone::Unavailable;
+    }
+    if (tree_has_symlinks(AT_FDCWD, source.c_str())) {
+        debug_print("Whole-tree clone skipped: the tree contains symlinks, which the walk follows");
+        return TreeClone::Unavailable;
+    }
+    debug_print("Cloning directory tree from " + source.string() + " to " + target.string());
+    if (clonefile(source.c_str(), target.c_str(), 0) != 0) {
+        int err = errno;
+        if (err != EEXIST && fs::exists(target)) {
+            errno = err;
+            print_error("Error cloning directory tree from " + source.string() + " to " + target.string());
+            return TreeClone::Failed;
+        }
+        debug_print(std::string("Whole-tree clone not possible: ") + strerror(err));
+        return TreeClone::Unavailable;
+    }
+    return TreeClone::Done;
+}
+
+// Recursively copy a directory
+bool copy_directory(const fs::path& source, const fs::path& target, const CopyOptions& options,
+                    const IgnoreFrame* ignores = nullptr) {
+    debug_print("Entering copy_directory()");
+    debug_print("Parameters: source = " + source.string() + ", target = " + target.string() +
+                ", preserve_permissions = " + std::to_string(options.preserve_permissions) +
+                ", backup = " + std::to_string(options.backup) +
+                ", update = " + std::to_string(options.update) +
+                ", store = " + options.store.string() +
+                ", reflink_dest = " + options.reflink_dest.string());
+
+    // Directory modes and times are only carried over when preserving permissions
+    DirFixupTable fixups;
+    DirFixupTable* fixups_ptr = options.preserve_permissions && !options.dry_run ? &fixups : nullptr;
+    size_t root_index = DirFixupTable::npos;
+    if (fixups_ptr) {
+        root_index = fixups.record(source, target, DirFixupTable::npos);
+    }
+    WalkTree tree(source, target, options.reflink_dest);
+    for (auto layer = options.layers.rbegin(); layer != options.layers.rend(); ++layer) {
+        tree.add_layer(*layer);
+    }
+    std::vector<FileJob> jobs;
+    bool ok = walk_tree(tree, 0, source, target, options, fixups_ptr, root_index, jobs, ignores);
+    debug_print("Walk found " + std::to_string(jobs.size()) + " files in " + std::to_string(tree.dir_count()) +
+                " directories, " + std::to_string(tree.names.bytes()) + " bytes of names");
+    if (options.dry_run) {
+        report_plan(jobs, tree, options, tree.dir_count());
+        if (options.mirror) {
+            delete_extraneous(tree.extraneous, options);
+        }
+        return ok;
+    }
+    // Deleting first frees space for the copy; a failed walk deletes nothing. As
+    // with rsync, a refused deletion still lets the copy run but fails the run.
+    bool deleted = true;
+    if (options.mirror && ok) {
+        deleted = delete_extraneous(tree.extraneous, options);
+    }
+    uint64_t total_bytes = 0;
+    for (const auto& job : jobs) {
+        total_bytes += job.size;
+    }
+    progress.total_bytes.store(total_bytes, std::memory_order_relaxed);
+    progress.total_files.store(jobs.size(), std::memory_order_relaxed);
+    ok = run_file_jobs(jobs, tree, options, fixups_ptr, ok);
+    if (fixups_ptr) {
+        fixups.complete(root_index);
+    }
+    ok = ok && !fixups.failed();
+    if (ok && !options.index.empty()) {
+        ok = summary_index.save(options.index, target);
+    }
+    if (ok && !options.manifest.empty()) {
+        ok = manifest.write(options.manifest, target, options.manifest_hash);
+    }
+    if (ok && options.verify) {
+        ok = verify_jobs(jobs, tree);
+    }
+    return ok && deleted;
+}
+
+// A target file considered for deduplication
+struct DedupeCandidate {
+    fs::path path;
+    struct stat st;
+    uint64_t hash = 0;
+    bool hashed = false;
+};
+
+// Compare two files byte for byte
+bool files_identical(const fs::path& a, const fs::path& b) {
+    int fd_a = open(a.c_str(), O_RDONLY);
+    if (fd_a < 0) {
+        print_error("Error opening " + a.string());
+        return false;
+    }
+    int fd_b = open(b.c_str(), O_RDONLY);
+    if (fd_b < 0) {
+        print_error("Error opening " + b.string());
+        close(fd_a);
+        return false;
+    }
+    std::vector<unsigned char> buffer_a(1 << 20), buffer_b(1 << 20);
+    bool identical = true;
+    while (identical) {
+        ssize_t n_a = read_full(fd_a, buffer_a.data(), buffer_a.size());
+        ssize_t n_b = read_full(fd_b, buffer_b.data(), buffer_b.size());
+        if (n_a < 0 || n_b < 0) {
+            print_error("Error comparing " + a.string() + " and " + b.string());
+            identical = false;
+        } else if (n_a != n_b || memcmp(buffer_a.data(), buffer_b.data(), n_a) != 0) {
+            identical = false;
+        } else if (n_a == 0) {
+            break;
+        }
+    }
+    close(fd_a);
+    close(fd_b);
+    return identical;
+}
+
+// Give staging the extended attributes and ACL of duplicate in place of the ones
+// its clone brought along, so that only the data ends up shared
+bool restore_attributes(const fs::path& duplicate, const fs::path& staging) {
+    int in = open(duplicate.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(staging.c_str(), O_RDONLY);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    bool ok = true;
+    ssize_t length = flistxattr(out, nullptr, 0, 0);
+    if (length > 0) {
+        std::vector<char> names(length);
+        length = flistxattr(out, names.data(), names.size(), 0);
+        for (ssize_t i = 0; i < length; i += strlen(&names[i]) + 1) {
+            ok = fremovexattr(out, &names[i], 0) == 0 && ok;
+        }
+    }
+    acl_t empty = acl_init(0);
+    if (empty) {
+        acl_set_fd_np(out, empty, ACL_TYPE_EXTENDED);
+        acl_free(empty);
+    }
+    ok = fcopyfile(in, out, nullptr, COPYFILE_ACL | COPYFILE_XATTR) == 0 && ok;
+    close(in);
+    close(out);
+    return ok;
+}
+
+// Replace duplicate with a clone of keeper, keeping the duplicate's mode, owner and
+// times. The clone is staged next to the duplicate and renamed over it, and the
+// swap is abandoned if the duplicate changed after it was compared.
+bool replace_with_clone(const fs::path& keeper, const DedupeCandidate& duplicate) {
+    fs::path staging = duplicate.path.parent_path() / (".cf-dedupe." + duplicate.path.filename().string());
+    debug_print("Replacing " + duplicate.path.string() + " with a clone of " + keeper.string());
+    if (clonefile(keeper.c_str(), staging.c_str(), CLONE_NOOWNERCOPY) != 0) {
+        print_error("Error cloning " + keeper.string() + " to " + staging.string());
+        return false;
+    }
+    // Attributes can only be changed while the file is writable
+    chmod(staging.c_str(), S_IRUSR | S_IWUSR);
+    if (!restore_attributes(duplicate.path, staging)) {
+        print_error("Error copying attributes from " + duplicate.path.string());
+        unlink(staging.c_str());
+        return false;
+    }
+    const struct stat& st = duplicate.st;
+    struct timespec times[2] = {st.st_atimespec, st.st_mtimespec};
+    chmod(staging.c_str(), st.st_mode & 07777);
+    if (chown(staging.c_str(), st.st_uid, st.st_gid) != 0 && errno != EPERM) {
+        print_error("Error setting owner on " + staging.string());
+    }
+    utimensat(AT_FDCWD, staging.c_str(), times, 0);
+
+    struct stat now;
+    if (lstat(duplicate.path.c_str(), &now) != 0 || now.st_ino != st.st_ino || now.st_size != st.st_size ||
+        now.st_mtimespec.tv_sec != st.st_mtimespec.tv_sec || now.st_mtimespec.tv_nsec != st.st_mtimespec.tv_nsec) {
+        debug_print("File changed during deduplication, leaving it alone: " + duplicate.path.string());
+        unlink(staging.c_str());
+        return true;
+    }
+    if (rename(staging.c_str(), duplicate.path.c_str()) != 0) {
+        print_error("Error replacing " + duplicate.path.string());
+        unlink(staging.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Whether a previous --dedupe already made the two files share their extents
+bool already_shared(const DedupeCandidate& keeper, const DedupeCandidate& duplicate) {
+    int a = open(keeper.path.c_str(), O_RDONLY);
+    if (a < 0) {
+        return false;
+    }
+    int b = open(duplicate.path.c_str(), O_RDONLY);
+    bool shared = b >= 0 && shares_extents(a, b, keeper.st.st_size);
+    if (b >= 0) {
+        close(b);
+    }
+    close(a);
+    return shared;
+}
+
+// Find files with identical contents under root and make them share storage.
+// Candidates are grouped by size, then by XXH64, and byte-compared before merging.
+bool dedupe_tree(const fs::path& root) {
+    debug_print("Entering dedupe_tree()");
+    debug_print("Parameters: root = " + root.string());
+
+    std::vector<DedupeCandidate> files;
+    try {
+        for (const auto& entry : fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied)) {
+            DedupeCandidate candidate;
+            candidate.path = entry.path();
+            if (lstat(candidate.path.c_str(), &candidate.st) != 0) {
+                print_error("Error reading " + candidate.path.string());
+                continue;
+            }
+            // Replacing one name of a hard link would split it from the others
+            // and free nothing
+            if (S_ISREG(candidate.st.st_mode) && candidate.st.st_size > 0 && candidate.st.st_nlink == 1) {
+                files.push_back(std::move(candidate));
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        print_error(e.what());
+        return false;
+    }
+
+    // Files can only share storage with files on the same volume, and the target
+    // may span mount points
+    std::sort(files.begin(), files.end(), [](const DedupeCandidate& a, const DedupeCandidate& b) {
+        if (a.st.st_dev != b.st.st_dev) return a.st.st_dev < b.st.st_dev;
+        if (a.st.st_size != b.st.st_size) return a.st.st_size < b.st.st_size;
+        return a.st.st_ino < b.st.st_ino;
+    });
+
+    // Only files sharing their volume and size with another file need hashing
+    std::vector<DedupeCandidate> candidates;
+    for (size_t i = 0; i < files.size();) {
+        size_t j = i;
+        while (j < files.size() && files[j].st.st_dev == files[i].st.st_dev &&
+               files[j].st.st_size == files[i].st.st_size) {
+            j++;
+        }
+        if (j - i > 1) {
+            for (size_t k = i; k < j; k++) {
+                candidates.push_back(std::move(files[k]));
+            }
+        }
+        i = j;
+    }
+    debug_print("Hashing " + std::to_string(candidates.size()) + " candidate files");
+    parallel_for(candidates.size(), [&](size_t i) {
+        candidates[i].hashed = hash_file(candidates[i].path, candidates[i].hash);
+    });
+
+    std::sort(candidates.begin(), candidates.end(), [](const DedupeCandidate& a, const DedupeCandidate& b) {
+        if (a.st.st_dev != b.st.st_dev) return a.st.st_dev < b.st.st_dev;
+        if (a.st.st_size != b.st.st_size) return a.st.st_size < b.st.st_size;
+        return a.hash < b.hash;
+    });
+    std::vector<std::pair<size_t, size_t>> groups;
+    for (size_t i = 0; i < candidates.size();) {
+        size_t j = i;
+        while (j < candidates.size() && candidates[j].st.st_dev == candidates[i].st.st_dev &&
+               candidates[j].st.st_size == candidates[i].st.st_size && candidates[j].hash == candidates[i].hash) {
+            j++;
+        }
+        if (j - i > 1) {
+            groups.emplace_back(i, j);
+        }
+        i = j;
+    }
+
+    std::atomic<uint64_t> files_merged{0};
+    std::atomic<uint64_t> bytes_reclaimed{0};
+    std::atomic<bool> ok{true};
+    parallel_for(groups.size(), [&](size_t g) {
+        const DedupeCandidate& keeper = candidates[groups[g].first];
+        if (!keeper.hashed) {
+            return;
+        }
+        for (size_t i = groups[g].first + 1; i < groups[g].second; i++) {
+            const DedupeCandidate& duplicate = candidates[i];
+            if (!duplicate.hashed || already_shared(keeper, duplicate) || !files_identical(keeper.path, duplicate.path)) {
+                continue;
+            }
+            if (!replace_with_clone(keeper.path, duplicate)) {
+                ok = false;
+                continue;
+            }
+            files_merged++;
+            bytes_reclaimed += duplicate.st.st_size;
+        }
+    });
+
+    std::cout << "Deduplicated " << files_merged << " files, reclaimed up to " << bytes_reclaimed << " bytes" << std::endl;
+    return ok;
+}
+
+// A snapshot name with every digit replaced, so that 2024-06-01 and 2024-06-02
+// have the same shape and notes or aaa_important do not
+std::string snapshot_shape(const std::string& name) {
+    std::string shape = name;
+    for (char& c : shape) {
+        if (c >= '0' && c <= '9') {
+            c = '#';
+        }
+    }
+    return shape;
+}
+
+// Remove the oldest snapshots next to target so that at most keep remain. Only
+// previous, and sibling directories named like it that sort before it, count as
+// snapshots, so names must sort chronologically (e.g. dates).
+bool prune_snapshots(const fs::path& target, const fs::path& previous, size_t keep) {
+    debug_print("Entering prune_snapshots()");
+    auto normalize = [](const fs::path& path) {
+        fs::path absolute = fs::absolute(path).lexically_normal();
+        return absolute.has_filename() ? absolute : absolute.parent_path();
+    };
+    fs::path absolute = normalize(target);
+    fs::path last = normalize(previous);
+    std::string shape = snapshot_shape(last.filename().string());
+    if (last.parent_path() != absolute.parent_path() || last.filename() >= absolute.filename() ||
+        snapshot_shape(absolute.filename().string()) != shape) {
+        std::cerr << "Not pruning: " << previous << " is not an older snapshot named like " << target << std::endl;
+        return true;
+    }
+    std::vector<fs::path> older;
+    try {
+        for (const auto& entry : fs::directory_iterator(absolute.parent_path())) {
+            fs::path name = entry.path().filename();
+            if (entry.is_directory() && !entry.is_symlink() && name <= last.filename() &&
+                snapshot_shape(name.string()) == shape) {
+                older.push_back(entry.path());
+            }
+        }
+        std::sort(older.begin(), older.end());
+        size_t total = older.size() + 1;
+        for (size_t i = 0; i < older.size() && total > keep; i++, total--) {
+            std::cout << "Pruning snapshot " << older[i] << std::endl;
+            fs::remove_all(older[i]);
+        }
+    } catch (const fs::filesystem_error& e) {
+        print_error(e.what());
+        return false;
+    }
+    return true;
 }
 
-// Debug output function
-void debug_print(const std::string& msg) {
-    if (debug_mode) {
-        std::cout << "[DEBUG] " << msg << std::endl;
+// --watch keeps the target in sync after the initial copy. Every copied directory
+// and file of the source is watched with a kqueue vnode filter, and a change marks
+// its directory dirty. Events are coalesced until the tree has been quiet for the
+// debounce window; then each dirty directory is resynced on its own: its files are
+// updated and new subdirectories are copied whole. Entries that cannot be watched
+// for lack of file descriptors leave their directory on a rescan list, which is
+// resynced with every batch and at least every kWatchRescan. If waiting for events
+// fails, events may have been lost and the whole tree is resynced; after
+// kWatchMaxFailures failures in a row the watch gives up.
+constexpr std::chrono::seconds kWatchRescan(30);
+constexpr size_t kWatchMaxFailures = 5;
+constexpr size_t kWatchFdReserve = 256; // descriptors left for copying
+volatile sig_atomic_t watch_stopped = 0;
+
+// The ignore frames a walk from source would have pushed above dir (relative to
+// source), so that a resync of dir alone honors its ancestors' ignore files.
+// frames owns them; the innermost is returned.
+const IgnoreFrame* ancestor_ignores(const fs::path& source, const std::string& dir,
+                                    std::vector<std::unique_ptr<IgnoreFrame>>& frames) {
+    const IgnoreFrame* innermost = nullptr;
+    if (dir == ".") {
+        return innermost;
+    }
+    fs::path path = source;
+    for (const auto& component : fs::path(dir)) {
+        int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) {
+            std::unique_ptr<IgnoreFrame> frame(new IgnoreFrame{innermost, {}, path_length(path)});
+            frame->rules.read(dfd, ".gitignore");
+            frame->rules.read(dfd, ".ignore");
+            frame->rules.compile();
+            close(dfd);
+            if (!frame->rules.empty()) {
+                innermost = frame.get();
+                frames.push_back(std::move(frame));
+            }
+        }
+        path /= component;
     }
+    return innermost;
 }
 
-// Clone a file using clonefile function
-bool clone_file(const fs::path& source, const fs::path& target, uint32_t flags = 0) {
-    debug_print("Entering clone_file()");
-    debug_print("Parameters: source = " + source.string() + ", target = " + target.string() + ", flags = " + std::to_string(flags));
+class TreeWatcher {
+public:
+    TreeWatcher(const fs::path& source, const fs::path& target) : source_(source), target_(target), kq_(kqueue()) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            rlim_t wanted = std::min<rlim_t>(limit.rlim_max, OPEN_MAX);
+            if (limit.rlim_cur < wanted) {
+                limit.rlim_cur = wanted;
+                setrlimit(RLIMIT_NOFILE, &limit);
+                getrlimit(RLIMIT_NOFILE, &limit);
+            }
+            max_watches_ = limit.rlim_cur > kWatchFdReserve ? size_t(limit.rlim_cur - kWatchFdReserve) : 0;
+        }
+    }
 
-    if (fs::exists(target)) {
-        debug_print("Target exists: " + target.string());
-        if (fs::is_directory(target)) {
-            debug_print("Target is a directory, cannot clone to a directory.");
-            errno = EEXIST; // Set errno to file exists
+    ~TreeWatcher() {
+        for (const auto& watch : watches_) {
+            if (watch.fd >= 0) {
+                close(watch.fd);
+            }
+        }
+        if (kq_ >= 0) {
+            close(kq_);
+        }
+    }
+
+    bool ok() const { return kq_ >= 0; }
+
+    // Watch dir (relative to the roots) and the copied entries below it that are
+    // not watched yet; entries without a target counterpart were filtered out
+    void add_tree(const std::string& dir) {
+        // Everything below dir is retried, and put back on the rescan list if
+        // it still cannot be watched
+        drop_unwatched(dir);
+        std::vector<std::string> dirs{dir};
+        std::vector<std::pair<std::string, std::string>> files; // path, directory
+        for (size_t i = 0; i < dirs.size(); i++) {
+            std::string current = dirs[i];
+            if (!watched_.count(current) && !watch(current, parent_of(current), true)) {
+                unwatched_.insert(current);
+            }
+            DIR* handle = opendir(absolute(source_, current).c_str());
+            if (!handle) {
+                continue;
+            }
+            while (struct dirent* entry = readdir(handle)) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                    continue;
+                }
+                std::string path = current == "." ? entry->d_name : current + "/" + entry->d_name;
+                struct stat st;
+                if (lstat(absolute(target_, path).c_str(), &st) != 0) {
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    dirs.push_back(path);
+                } else if (!watched_.count(path)) {
+                    files.emplace_back(path, current);
+                }
+            }
+            closedir(handle);
+        }
+        for (const auto& file : files) {
+            if (!watch(file.first, file.second, false)) {
+                unwatched_.insert(file.second);
+            }
+        }
+        debug_print("Watching " + std::to_string(watched_.size()) + " entries, " +
+                    std::to_string(unwatched_.size()) + " directories rescanned instead");
+    }
+
+    // Block until something changes, then collect events until none has arrived
+    // for debounce, and return the directories to resync. Returns false once
+    // interrupted by a signal.
+    bool wait(std::chrono::milliseconds debounce, std::set<std::string>& dirty) {
+        struct timespec rescan = {kWatchRescan.count(), 0};
+        struct timespec quiet = {time_t(debounce.count() / 1000), long(debounce.count() % 1000) * 1000000};
+        size_t received = collect(unwatched_.empty() ? nullptr : &rescan, dirty);
+        while (received > 0 && !watch_stopped) {
+            received = collect(&quiet, dirty);
+        }
+        for (auto it = unwatched_.begin(); it != unwatched_.end();) {
+            it = fs::is_directory(absolute(source_, *it)) ? std::next(it) : unwatched_.erase(it);
+        }
+        dirty.insert(unwatched_.begin(), unwatched_.end());
+        return !watch_stopped && !failing();
+    }
+
+    // Whether events may have been lost since the last call, so that the whole
+    // tree needs a resync
+    bool take_full_rescan() {
+        bool rescan = full_rescan_;
+        full_rescan_ = false;
+        return rescan;
+    }
+
+    bool failing() const { return failures_ >= kWatchMaxFailures; }
+
+private:
+    struct Watch {
+        int fd;
+        std::string path;
+        std::string dir; // directory to resync when it changes
+    };
+
+    static std::string parent_of(const std::string& path) {
+        size_t slash = path.rfind('/');
+        return path == "." ? std::string() : slash == std::string::npos ? "." : path.substr(0, slash);
+    }
+
+    static fs::path absolute(const fs::path& root, const std::string& path) {
+        return path == "." ? root : root / path;
+    }
+
+    bool watch(const std::string& path, const std::string& dir, bool is_dir) {
+        if (watched_.size() >= max_watches_) {
+            return false;
+        }
+        int fd = open(absolute(source_, path).c_str(), O_EVTONLY);
+        if (fd < 0) {
             return false;
+        }
+        // Slots of forgotten watches are reused, so churn does not grow the table
+        size_t index = watches_.size();
+        if (free_.empty()) {
+            watches_.push_back({fd, path, is_dir ? path : dir});
         } else {
-            debug_print("Target already exists and is not a directory: " + target.string());
-            return false; // Don't proceed if the file already exists and is not a directory
+            index = free_.back();
+            free_.pop_back();
+            watches_[index] = {fd, path, is_dir ? path : dir};
         }
-    } else {
-        debug_print("Target does not exist, ready to clone.");
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME,
+               0, reinterpret_cast<void*>(index));
+        if (kevent(kq_, &change, 1, nullptr, 0, nullptr) != 0) {
+            close(fd);
+            watches_[index].fd = -1;
+            free_.push_back(index);
+            return false;
+        }
+        watched_[path] = index;
+        return true;
     }
 
-    debug_print("Cloning file from " + source.string() + " to " + target.string());
-    int result = clonefile(source.c_str(), target.c_str(), flags);
-    if (result != 0) {
-        print_error("Error cloning file from " + source.string() + " to " + target.string());
+    // Drop the watch on path and, for a directory, on everything below it
+    void forget(const std::string& path) {
+        std::string prefix = path + "/";
+        for (auto it = watched_.begin(); it != watched_.end();) {
+            if (it->first == path || it->first.compare(0, prefix.size(), prefix) == 0) {
+                close(watches_[it->second].fd);
+                watches_[it->second].fd = -1;
+                free_.push_back(it->second);
+                it = watched_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        drop_unwatched(path);
+    }
+
+    // Take dir and everything below it off the rescan list
+    void drop_unwatched(const std::string& dir) {
+        std::string prefix = dir + "/";
+        for (auto it = unwatched_.begin(); it != unwatched_.end();) {
+            if (dir == "." || *it == dir || it->compare(0, prefix.size(), prefix) == 0) {
+                it = unwatched_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Wait up to timeout (forever if null) for events and mark their directories
+    size_t collect(const struct timespec* timeout, std::set<std::string>& dirty) {
+        struct kevent events[256];
+        int n = kevent(kq_, nullptr, 0, events, 256, timeout);
+        if (n < 0) {
+            if (errno != EINTR) {
+                // Events may have been lost; rescan the whole tree, backing off
+                // while the failures repeat
+                print_error("Error waiting for changes");
+                full_rescan_ = true;
+                failures_++;
+                struct timespec delay = {time_t(1) << std::min<size_t>(failures_, 5), 0};
+                nanosleep(&delay, nullptr);
+            }
+            return 0;
+        }
+        failures_ = 0;
+        for (int i = 0; i < n; i++) {
+            Watch& watch = watches_[reinterpret_cast<size_t>(events[i].udata)];
+            if (watch.fd < 0) {
+                continue;
+            }
+            dirty.insert(watch.dir);
+            // A deleted or renamed entry is gone from here; its parent resyncs
+            if (events[i].fflags & (NOTE_DELETE | NOTE_RENAME)) {
+                std::string parent = parent_of(watch.path);
+                if (!parent.empty()) {
+                    dirty.insert(parent);
+                }
+                forget(watch.path);
+            }
+        }
+        return size_t(n);
+    }
+
+    fs::path source_;
+    fs::path target_;
+    int kq_;
+    size_t max_watches_ = 0;
+    std::vector<Watch> watches_;
+    std::vector<size_t> free_; // indexes in watches_ of forgotten watches
+    std::unordered_map<std::string, size_t> watched_; // path to index in watches_
+    std::set<std::string> unwatched_;
+    bool full_rescan_ = false;
+    size_t failures_ = 0; // kevent() failures in a row
+};
+
+void stop_watching(int) {
+    watch_stopped = 1;
+}
+
+// Keep target in sync with source until interrupted (SIGINT or SIGTERM)
+bool watch_tree(const fs::path& source, const fs::path& target, const CopyOptions& options,
+                std::chrono::milliseconds debounce) {
+    TreeWatcher watcher(source, target);
+    if (!watcher.ok()) {
+        print_error("Error creating kqueue");
         return false;
     }
-    debug_print("Successfully cloned " + source.string() + " to " + target.string());
+    struct sigaction action = {};
+    action.sa_handler = stop_watching; // no SA_RESTART, so kevent() returns
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // Resyncs cover one directory each; the index and manifest describe whole runs
+    CopyOptions resync = options;
+    resync.shallow = true;
+    resync.index.clear();
+    resync.manifest.clear();
+
+    watcher.add_tree(".");
+    std::cout << "Watching " << source << " for changes" << std::endl;
+    std::set<std::string> dirty;
+    while (watcher.wait(debounce, dirty)) {
+        if (watcher.take_full_rescan()) {
+            CopyOptions full = resync;
+            full.shallow = false;
+            bool ok = copy_directory(source, target, full);
+            watcher.add_tree(".");
+            dirty.clear();
+            std::cout << "Resynced the whole tree" << (ok ? "" : " with errors") << std::endl;
+            continue;
+        }
+        size_t synced = 0;
+        bool ok = true;
+        for (const auto& dir : dirty) {
+            fs::path from = dir == "." ? source : source / dir;
+            fs::path to = dir == "." ? target : target / dir;
+            // Removed directories are handled by their parent's resync, and
+            // directories without a target were filtered out
+            if (!fs::is_directory(from) || !fs::is_directory(to)) {
+                continue;
+            }
+            debug_print("Resyncing " + from.string());
+            std::vector<std::unique_ptr<IgnoreFrame>> frames;
+            const IgnoreFrame* ignores = options.gitignore ? ancestor_ignores(source, dir, frames) : nullptr;
+            ok = copy_directory(from, to, resync, ignores) && ok;
+            watcher.add_tree(dir);
+            synced++;
+        }
+        dirty.clear();
+        if (synced > 0) {
+            std::cout << "Synced " << synced << (synced == 1 ? " directory" : " directories")
+                      << (ok ? "" : " with errors") << std::endl;
+        }
+    }
+    if (watcher.failing()) {
+        std::cerr << "Stopped watching " << source << ": waiting for changes keeps failing" << std::endl;
+        return false;
+    }
+    std::cout << "Stopped watching " << source << std::endl;
     return true;
 }
 
-// Compare last modification times of two files
-bool is_newer(const fs::path& source, const fs::path& target) {
-    debug_print("Entering is_newer()");
-    debug_print("Parameters: source = " + source.string() + ", target = " + target.string());
-    return fs::last_write_time(source) > fs::last_write_time(target);
-}
+// Renders the progress counters at a fixed interval on its own thread, so workers
+// never format output or take locks to report progress
+class ProgressReporter {
+public:
+    explicit ProgressReporter(std::chrono::milliseconds interval) : interval_(interval) {}
 
-// Recursively copy a directory
-bool copy_directory(const fs::path& source, const fs::path& target, bool preserve_permissions, bool backup, bool update) {
-    debug_print("Entering copy_directory()");
-    debug_print("Parameters: source = " + source.string() + ", target = " + target.string() +
-                ", preserve_permissions = " + std::to_string(preserve_permissions) +
-                ", backup = " + std::to_string(backup) +
-                ", update = " + std::to_string(update));
+    ~ProgressReporter() { stop(); }
 
-    try {
-        debug_print("Creating directory iterator for source: " + source.string());
-        for (const auto& entry : fs::directory_iterator(source)) {
-            const auto& path = entry.path();
-            fs::path target_path = target / path.filename();
+    void start() {
+        last_time_ = std::chrono::steady_clock::now();
+        thread_ = std::thread([this]() { run(); });
+    }
 
-            if (fs::is_directory(path)) {
-                debug_print("Found directory: " + path.string());
-                debug_print("Creating directory: " + target_path.string());
-                fs::create_directory(target_path);
-                if (!copy_directory(path, target_path, preserve_permissions, backup, update)) {
-                    return false;
-                }
-            } else {
-                debug_print("Found file: " + path.string());
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+        render(true);
+    }
 
-                // Update mode: only copy if source file is newer
-                if (update && fs::exists(target_path) && !is_newer(path, target_path)) {
-                    debug_print("Skipping file (not newer): " + path.string());
-                    continue;
-                }
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, interval_, [this]() { return stopping_; })) {
+            render(false);
+        }
+    }
 
-                if (backup && fs::exists(target_path)) {
-                    debug_print("Backing up file: " + target_path.string());
-                    fs::copy_file(target_path, target_path.string() + "~", fs::copy_options::overwrite_existing);
-                }
+    void render(bool final) {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t cloned = progress.bytes_cloned.load(std::memory_order_relaxed);
+        uint64_t copied = progress.bytes_copied.load(std::memory_order_relaxed);
+        uint64_t skipped = progress.bytes_skipped.load(std::memory_order_relaxed);
+        uint64_t work = cloned + copied;
+        uint64_t done = work + skipped;
+        uint64_t files = progress.files.load(std::memory_order_relaxed);
+        uint64_t total_files = progress.total_files.load(std::memory_order_relaxed);
+        uint64_t total_bytes = progress.total_bytes.load(std::memory_order_relaxed);
 
-                if (!clone_file(path, target_path)) {
-                    return false;
-                }
+        // Smoothed throughput over recent intervals. Skipped files cost no transfer
+        // and are left out, so they do not inflate the rate.
+        double seconds = std::chrono::duration<double>(now - last_time_).count();
+        if (seconds > 0) {
+            double instant = (work - last_work_) / seconds;
+            rate_ = rate_ == 0 ? instant : 0.7 * rate_ + 0.3 * instant;
+        }
+        last_time_ = now;
+        last_work_ = work;
 
-                // Preserve permissions if required
-                if (preserve_permissions) {
-                    debug_print("Preserving permissions for: " + target_path.string());
-                    fs::permissions(target_path, fs::status(path).permissions());
-                }
+        std::string line;
+        if (total_files == 0) {
+            line = "Scanning: " + std::to_string(progress.dirs.load(std::memory_order_relaxed)) + " directories";
+        } else {
+            line = std::to_string(files) + "/" + std::to_string(total_files) + " files, " + format_bytes(done) + "/" +
+                   format_bytes(total_bytes) + " (cloned " + format_bytes(cloned) + ", copied " + format_bytes(copied) +
+                   (skipped > 0 ? ", skipped " + format_bytes(skipped) : std::string()) + "), " +
+                   format_bytes(rate_) + "/s";
+            if (!final && rate_ > 0 && total_bytes > done) {
+                uint64_t eta = (total_bytes - done) / rate_;
+                char text[32];
+                snprintf(text, sizeof(text), ", ETA %llu:%02llu:%02llu", (unsigned long long)(eta / 3600),
+                         (unsigned long long)(eta / 60 % 60), (unsigned long long)(eta % 60));
+                line += text;
             }
         }
-    } catch (const fs::filesystem_error& e) {
-        print_error(e.what());
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "\r" << line << "\033[K" << (final ? "\n" : "") << std::flush;
+    }
+
+    std::chrono::milliseconds interval_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::chrono::steady_clock::time_point last_time_;
+    uint64_t last_work_ = 0;
+    double rate_ = 0;
+};
+
+// Parse a byte count with an optional K, M or G suffix; returns false if malformed
+bool parse_size(const std::string& text, uint64_t& size) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (errno != 0 || end == text.c_str()) {
+        return false;
+    }
+    std::string suffix = end;
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    size = value;
+    return true;
+}
+
+// Parse a duration such as 90s, 30m, 12h or 7d (plain numbers are seconds)
+bool parse_duration(const std::string& text, time_t& seconds) {
+    char* end = nullptr;
+    errno = 0;
+    long long value = strtoll(text.c_str(), &end, 10);
+    if (errno != 0 || end == text.c_str() || value < 0) {
+        return false;
+    }
+    std::string suffix = end;
+    long long unit = suffix.empty() || suffix == "s" ? 1 : suffix == "m" ? 60 : suffix == "h" ? 3600 : suffix == "d" ? 86400 : 0;
+    if (unit == 0) {
         return false;
     }
+    seconds = time_t(value * unit);
+    return true;
+}
+
+// Add one rule per line of file; blank lines and lines starting with # are ignored
+bool read_filter_file(const std::string& path, bool include, FilterRules& filter) {
+    std::ifstream in(path);
+    if (!in) {
+        print_error("Error opening " + path);
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[0] != '#') {
+            filter.add(line, include);
+        }
+    }
     return true;
 }
 
 // Show usage instructions
 void show_usage(const std::string& program_name) {
-    std::cerr << "Usage: " << program_name << " [-a] [-b] [-f] [-i] [-R] [-p] [-u] [-d] <source> <target>" << std::endl;
+    std::cerr << "Usage: " << program_name << " [-a] [-b] [-f] [-i] [-R] [-p] [-u] [-d] [--dedupe] [--store DIR]" << std::endl;
+    std::cerr << "       [--reflink-dest PREV [--checksum] [--keep N]] [--direct-threshold SIZE] [--nocache]" << std::endl;
+    std::cerr << "       [--parallel-threshold SIZE] [--no-preallocate]" << std::endl;
+    std::cerr << "       [--jobs N] [--inode-order] [--progress] [--dry-run]" << std::endl;
+    std::cerr << "       [--include PATTERN] [--exclude PATTERN] [--exclude-from FILE]" << std::endl;
+    std::cerr << "       [--min-size SIZE] [--max-size SIZE] [--newer-than AGE] [--older-than AGE] [--gitignore]" << std::endl;
+    std::cerr << "       [--verify] [--manifest FILE [--manifest-hash sha256|xxh64]] [--delete [--max-delete N]]" << std::endl;
+    std::cerr << "       [--index FILE] [--watch [--debounce MS]] [--layer DIR ...]" << std::endl;
+    std::cerr << "       <source> <target>" << std::endl;
+    std::cerr << "       " << program_name << " --calibrate <directory>" << std::endl;
     std::cerr << "Options:" << std::endl;
     std::cerr << "  -a  Archive mode (recursive and preserve permissions)" << std::endl;
     std::cerr << "  -b  Backup existing files" << std::endl;
@@ -128,6 +4054,35 @@ void show_usage(const std::string& program_name) {
     std::cerr << "  -p  Preserve file permissions" << std::endl;
     std::cerr << "  -u  Update only copy newer files" << std::endl;
     std::cerr << "  -d  Enable debug mode" << std::endl;
+    std::cerr << "  --dedupe  After copying, share storage between identical files in the target" << std::endl;
+    std::cerr << "  --store DIR  Materialize files by cloning from a content-addressed store" << std::endl;
+    std::cerr << "  --reflink-dest PREV  Clone files unchanged since snapshot PREV from it" << std::endl;
+    std::cerr << "  --checksum  Compare against PREV by content instead of size and mtime" << std::endl;
+    std::cerr << "  --keep N  Keep at most N snapshots next to the target, removing the oldest (needs --reflink-dest)" << std::endl;
+    std::cerr << "  --direct-threshold SIZE  Byte copies of files this large bypass the page cache (default 1G)" << std::endl;
+    std::cerr << "  --nocache  Keep byte copies from filling the page cache" << std::endl;
+    std::cerr << "  --parallel-threshold SIZE  Byte copies of files this large use several threads (default 4G)" << std::endl;
+    std::cerr << "  --no-preallocate  Do not reserve space for byte copies up front" << std::endl;
+    std::cerr << "  --jobs N  Copy a tree's files on N threads (default one per core)" << std::endl;
+    std::cerr << "  --inode-order  Read directories in inode order and copy files in disk order" << std::endl;
+    std::cerr << "  --progress  Show files, bytes, throughput and ETA while copying" << std::endl;
+    std::cerr << "  --dry-run  Report what would be cloned, copied or skipped without writing anything" << std::endl;
+    std::cerr << "  --include PATTERN  Copy entries matching PATTERN even if a later rule excludes them" << std::endl;
+    std::cerr << "  --exclude PATTERN  Skip entries whose name matches PATTERN (trailing / for directories only)" << std::endl;
+    std::cerr << "  --exclude-from FILE  Read exclude patterns from FILE, one per line" << std::endl;
+    std::cerr << "  --min-size SIZE, --max-size SIZE  Only copy files within these sizes" << std::endl;
+    std::cerr << "  --newer-than AGE, --older-than AGE  Only copy files modified within / before AGE (e.g. 7d, 12h)" << std::endl;
+    std::cerr << "  --verify  After copying, check each file shares extents with its source or hashes the same" << std::endl;
+    std::cerr << "  --layer DIR  Merge DIR below the source; repeat for more layers, lowest first (.wh. whiteouts apply)" << std::endl;
+    std::cerr << "  --watch  After copying, keep the target in sync with the source until interrupted (implies -u)" << std::endl;
+    std::cerr << "  --debounce MS  Wait for MS milliseconds without changes before syncing (default 500)" << std::endl;
+    std::cerr << "  --index FILE  Keep per-directory summaries in FILE; with -u, unchanged directories are skipped" << std::endl;
+    std::cerr << "  --delete  Mirror the source: remove target entries that are not in the source" << std::endl;
+    std::cerr << "  --max-delete N  Delete nothing if --delete would remove more than N entries (default 1000)" << std::endl;
+    std::cerr << "  --manifest FILE  Write checksums of the copied files to FILE, relative to the target" << std::endl;
+    std::cerr << "  --manifest-hash  Checksum for --manifest: sha256 (SHA256SUMS format, default) or xxh64" << std::endl;
+    std::cerr << "  --gitignore  Skip entries ignored by .gitignore and .ignore files in the source tree" << std::endl;
+    std::cerr << "  --calibrate  Measure the fastest copy engine per file size on a directory's filesystem" << std::endl;
 }
 
 // Main function simulating cp command
@@ -139,12 +4094,15 @@ int main(int argc, char* argv[]) {
     }
 
     bool archive = false;
-    bool backup = false;
     bool force = false;
     bool interactive = false;
     bool recursive = false;
-    bool preserve_permissions = false;
-    bool update = false;
+    CopyOptions options;
+    bool dedupe = false;
+    bool calibrate = false;
+    bool show_progress = false;
+    bool watch = false;
+    std::chrono::milliseconds debounce(500);
     fs::path source, target;
 
     int i = 1;
@@ -154,10 +4112,10 @@ int main(int argc, char* argv[]) {
         if (arg == "-a") {
             archive = true;
             recursive = true;
-            preserve_permissions = true;
+            options.preserve_permissions = true;
             debug_print("Option set: archive mode");
         } else if (arg == "-b") {
-            backup = true;
+            options.backup = true;
             debug_print("Option set: backup");
         } else if (arg == "-f") {
             force = true;
@@ -169,14 +4127,180 @@ int main(int argc, char* argv[]) {
             recursive = true;
             debug_print("Option set: recursive copy");
         } else if (arg == "-p") {
-            preserve_permissions = true;
+            options.preserve_permissions = true;
             debug_print("Option set: preserve permissions");
         } else if (arg == "-u") {
-            update = true;
+            options.update = true;
             debug_print("Option set: update mode");
         } else if (arg == "-d") {
             debug_mode = true; // Enable debug mode
             debug_print("Debug mode enabled");
+        } else if (arg == "--dedupe") {
+            dedupe = true;
+            debug_print("Option set: deduplicate target");
+        } else if (arg == "--store") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.store = argv[++i];
+            debug_print("Option set: content store " + options.store.string());
+        } else if (arg == "--reflink-dest") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.reflink_dest = argv[++i];
+            debug_print("Option set: previous snapshot " + options.reflink_dest.string());
+        } else if (arg == "--checksum") {
+            options.checksum = true;
+            debug_print("Option set: compare by checksum");
+        } else if (arg == "--keep") {
+            if (i + 1 >= argc || std::atoi(argv[i + 1]) <= 0) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.keep = std::atoi(argv[++i]);
+            debug_print("Option set: keep " + std::to_string(options.keep) + " snapshots");
+        } else if (arg == "--direct-threshold") {
+            if (i + 1 >= argc || !parse_size(argv[i + 1], options.direct_threshold)) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            i++;
+            debug_print("Option set: direct I/O threshold " + std::to_string(options.direct_threshold));
+        } else if (arg == "--nocache") {
+            options.nocache = true;
+            debug_print("Option set: no cache");
+        } else if (arg == "--parallel-threshold") {
+            if (i + 1 >= argc || !parse_size(argv[i + 1], options.parallel_threshold)) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            i++;
+            debug_print("Option set: parallel copy threshold " + std::to_string(options.parallel_threshold));
+        } else if (arg == "--no-preallocate") {
+            options.preallocate = false;
+            debug_print("Option set: no preallocation");
+        } else if (arg == "--jobs") {
+            if (i + 1 >= argc || std::atoi(argv[i + 1]) <= 0) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.jobs = std::atoi(argv[++i]);
+            debug_print("Option set: " + std::to_string(options.jobs) + " jobs");
+        } else if (arg == "--inode-order") {
+            options.inode_order = true;
+            debug_print("Option set: inode order");
+        } else if (arg == "--progress") {
+            show_progress = true;
+            debug_print("Option set: progress");
+        } else if (arg == "--dry-run") {
+            options.dry_run = true;
+            debug_print("Option set: dry run");
+        } else if (arg == "--include" || arg == "--exclude") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.filter.add(argv[++i], arg == "--include");
+            debug_print("Option set: " + arg.substr(2) + " " + argv[i]);
+        } else if (arg == "--exclude-from") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            if (!read_filter_file(argv[++i], false, options.filter)) {
+                return 1;
+            }
+            debug_print("Option set: exclude patterns from " + std::string(argv[i]));
+        } else if (arg == "--min-size" || arg == "--max-size") {
+            uint64_t size;
+            if (i + 1 >= argc || !parse_size(argv[i + 1], size)) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            (arg == "--min-size" ? options.filter.min_size : options.filter.max_size) = off_t(size);
+            debug_print("Option set: " + arg.substr(2) + " " + argv[++i]);
+        } else if (arg == "--newer-than" || arg == "--older-than") {
+            time_t age;
+            if (i + 1 >= argc || !parse_duration(argv[i + 1], age)) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            (arg == "--newer-than" ? options.filter.newer_than : options.filter.older_than) = time(nullptr) - age;
+            debug_print("Option set: " + arg.substr(2) + " " + argv[++i]);
+        } else if (arg == "--layer") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.layers.push_back(argv[++i]);
+            debug_print("Option set: layer " + options.layers.back().string());
+        } else if (arg == "--watch") {
+            watch = true;
+            options.update = true;
+            options.replace_outdated = true;
+            debug_print("Option set: watch for changes");
+        } else if (arg == "--debounce") {
+            char* end = nullptr;
+            long value = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+            if (i + 1 >= argc || *end != '\0' || value < 0) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            debounce = std::chrono::milliseconds(value);
+            debug_print("Option set: debounce " + std::to_string(value) + " ms");
+            i++;
+        } else if (arg == "--index") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.index = argv[++i];
+            if (!summary_index.load(options.index)) {
+                print_error("Error reading index " + options.index.string());
+                return 1;
+            }
+            debug_print("Option set: index " + options.index.string());
+        } else if (arg == "--delete") {
+            options.mirror = true;
+            debug_print("Option set: delete extraneous target entries");
+        } else if (arg == "--max-delete") {
+            char* end = nullptr;
+            unsigned long long value = i + 1 < argc ? strtoull(argv[i + 1], &end, 10) : 0;
+            if (i + 1 >= argc || *end != '\0') {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.max_delete = value;
+            debug_print("Option set: max delete " + std::to_string(value));
+            i++;
+        } else if (arg == "--manifest") {
+            if (i + 1 >= argc) {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.manifest = argv[++i];
+            debug_print("Option set: manifest " + options.manifest.string());
+        } else if (arg == "--manifest-hash") {
+            std::string kind = i + 1 < argc ? argv[i + 1] : "";
+            if (kind != "sha256" && kind != "xxh64") {
+                show_usage(argv[0]);
+                return 1;
+            }
+            options.manifest_hash = kind == "sha256" ? ManifestHash::Sha256 : ManifestHash::Xxh64;
+            debug_print("Option set: manifest hash " + kind);
+            i++;
+        } else if (arg == "--verify") {
+            options.verify = true;
+            debug_print("Option set: verify after copying");
+        } else if (arg == "--gitignore") {
+            options.gitignore = true;
+            debug_print("Option set: honor .gitignore files");
+        } else if (arg == "--calibrate") {
+            calibrate = true;
+            debug_print("Option set: calibrate");
         } else {
             if (source.empty()) {
                 source = argv[i];
@@ -193,6 +4317,18 @@ int main(int argc, char* argv[]) {
         i++;
     }
 
+    // Range copies of huge files share one extra thread per job
+    range_threads.reset(options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency()));
+
+    // Calibration only needs the directory to measure
+    if (calibrate) {
+        if (source.empty() || !target.empty()) {
+            show_usage(argv[0]);
+            return 1;
+        }
+        return calibrate_filesystem(source) ? 0 : 1;
+    }
+
     // Check if source file or directory exists
     debug_print("Checking if source exists");
     if (!fs::exists(source)) {
@@ -200,7 +4336,64 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (!options.layers.empty()) {
+        if (!recursive || !fs::is_directory(source) || watch || options.gitignore) {
+            std::cerr << "--layer needs a directory source and -R, and cannot be combined with --watch or --gitignore"
+                      << std::endl;
+            return 1;
+        }
+        // The source and its layers share a 32-bit mask per directory
+        if (options.layers.size() > 31) {
+            std::cerr << "At most 31 --layer directories are supported" << std::endl;
+            return 1;
+        }
+        for (const auto& layer : options.layers) {
+            if (!fs::is_directory(layer)) {
+                std::cerr << "Layer is not a directory: " << layer << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (options.keep > 0 && options.reflink_dest.empty()) {
+        std::cerr << "--keep needs --reflink-dest" << std::endl;
+        return 1;
+    }
+
+    if (watch && !(recursive && fs::is_directory(source))) {
+        std::cerr << "--watch needs a directory source and -R" << std::endl;
+        return 1;
+    }
+
+    // Dry run: plan against the current state of source and target, then stop
+    if (options.dry_run) {
+        fs::path existing = target;
+        while (!existing.empty() && !fs::exists(existing)) {
+            existing = existing.parent_path();
+        }
+        load_engine_table(existing.empty() ? fs::path(".") : existing, options.engines);
+        if (fs::is_directory(source)) {
+            if (!recursive) {
+                std::cerr << "Source is a directory. Use -R option for recursive copy." << std::endl;
+                return 1;
+            }
+            return copy_directory(source, target, options) ? 0 : 1;
+        }
+        fs::path target_path = fs::is_directory(target) ? target / source.filename() : target;
+        WalkTree tree(source.parent_path(), target_path.parent_path(), fs::path());
+        std::string name = source.filename().string();
+        std::vector<FileJob> jobs{{tree.names.intern(name.c_str(), name.size()), 0, TargetState::Unknown, 0, DirFixupTable::npos,
+                                   off_t(fs::file_size(source))}};
+        report_plan(jobs, tree, options, 0);
+        return 0;
+    }
+
+    if (!options.store.empty() && !init_store(options.store)) {
+        return 1;
+    }
+
     // Ensure the target path exists or create it
+    bool tree_cloned = false;
     debug_print("Checking if target exists");
     if (fs::exists(target)) {
         debug_print("Target exists: " + target.string());
@@ -215,7 +4408,7 @@ int main(int argc, char* argv[]) {
                     return 0;
                 }
             }
-            if (backup) {
+            if (options.backup) {
                 debug_print("Backing up existing target file");
                 fs::copy_file(target, target.string() + "~", fs::copy_options::overwrite_existing);
             }
@@ -227,19 +4420,40 @@ int main(int argc, char* argv[]) {
             debug_print("Target is a directory");
         }
     } else {
-        // If target is not found and source is a directory, create target directory
+        // If target is not found and source is a directory, clone the whole tree in
+        // one call when possible, otherwise create the target directory
         if (fs::is_directory(source)) {
-            debug_print("Creating target directory: " + target.string());
-            fs::create_directory(target);
+            TreeClone result = recursive && whole_tree_clone_possible(options) ? clone_tree(source, target)
+                                                                                : TreeClone::Unavailable;
+            if (result == TreeClone::Failed) {
+                return 1;
+            }
+            tree_cloned = result == TreeClone::Done;
+            if (!tree_cloned) {
+                debug_print("Creating target directory: " + target.string());
+                fs::create_directory(target);
+            }
         }
     }
 
+    // Dispatch by the target filesystem's calibration, if it has been calibrated
+    fs::path target_dir = fs::is_directory(target) ? target : target.parent_path();
+    load_engine_table(target_dir.empty() ? fs::path(".") : target_dir, options.engines);
+
+    // Rendered until the copy finishes; the final line is printed on destruction
+    ProgressReporter reporter(std::chrono::milliseconds(1000));
+    if (show_progress) {
+        reporter.start();
+    }
+
     // Process file or directory
     if (fs::is_directory(source)) {
         debug_print("Source is a directory");
         if (recursive) {
             debug_print("Recursive copy enabled");
-            if (!copy_directory(source, target, preserve_permissions, backup, update)) {
+            if (tree_cloned) {
+                debug_print("Tree cloned in one call, nothing left to copy");
+            } else if (!copy_directory(source, target, options)) {
                 return 1; // Return error code
             }
         } else {
@@ -269,23 +4483,80 @@ int main(int argc, char* argv[]) {
                     return 0;
                 }
             }
-            if (backup) {
+            if (options.backup) {
                 debug_print("Backing up existing target file");
                 fs::copy_file(target_path, target_path.string() + "~", fs::copy_options::overwrite_existing);
             }
         }
 
-        if (!clone_file(source, target_path)) {
+        struct stat st;
+        if (stat(source.c_str(), &st) == 0) {
+            progress.total_bytes.store(st.st_size, std::memory_order_relaxed);
+        }
+        progress.total_files.store(1, std::memory_order_relaxed);
+        StreamDigest digest(options.manifest_hash);
+        if (!options.manifest.empty()) {
+            stream_digest = &digest;
+        }
+        fs::path target_dir = target_path.parent_path().empty() ? fs::path(".") : target_path.parent_path();
+        struct stat target_dir_st;
+        VolumeCaps caps;
+        if (stat(target_dir.c_str(), &target_dir_st) == 0) {
+            caps = volume_caps.get(st.st_dev, target_dir_st.st_dev, source, target_dir);
+        }
+        bool cloned = clone_entry(source, target_path, options, &caps);
+        stream_digest = nullptr;
+        if (!cloned) {
             return 1; // Return error code
         }
+        if (!options.manifest.empty()) {
+            manifest.add(target_path.filename(), digest.length() == uint64_t(st.st_size) ? digest.hex() : std::string());
+            fs::path root = target_path.parent_path();
+            if (!manifest.write(options.manifest, root.empty() ? fs::path(".") : root, options.manifest_hash)) {
+                return 1;
+            }
+        }
+        if (uint64_t(st.st_size) > thread_bytes_copied) {
+            progress.bytes_cloned.fetch_add(st.st_size - thread_bytes_copied, std::memory_order_relaxed);
+        }
+        progress.files.fetch_add(1, std::memory_order_relaxed);
 
         // Preserve permissions
-        if (preserve_permissions) {
+        if (options.preserve_permissions) {
             debug_print("Preserving permissions for: " + target_path.string());
             fs::permissions(target_path, fs::status(source).permissions());
         }
+
+        if (options.verify) {
+            VerifyResult result = verify_file(source, target_path, st.st_size);
+            if (result == VerifyResult::Mismatched) {
+                std::cout << "Mismatch: " << target_path.string() << std::endl;
+            }
+            if (result == VerifyResult::Mismatched || result == VerifyResult::Failed) {
+                return 1;
+            }
+            std::cout << "Verified " << target_path.string()
+                      << (result == VerifyResult::Shared ? ": shares extents with the source" : ": matched by hash")
+                      << std::endl;
+        }
     }
 
+    reporter.stop();
     std::cout << "Successfully copied from " << source << " to " << target << std::endl;
+
+    if (options.keep > 0 && fs::is_directory(source) && !prune_snapshots(target, options.reflink_dest, options.keep)) {
+        return 1;
+    }
+
+    // Files that arrived as byte copies or already existed may duplicate each other
+    if (dedupe && fs::is_directory(target)) {
+        if (!dedupe_tree(target)) {
+            return 1;
+        }
+    }
+
+    if (watch && !watch_tree(source, target, options, debounce)) {
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file